@@ -23,14 +23,105 @@ namespace kisyshot::ast {
             bool canDiscard;
         } regs[16];
 
-        std::string opName[11];
+        std::string opName[Binary_op::NumOps];
 
         Register rs, rt, rd;
 
+        // 存放合并全局变量块基址的寄存器，不参与分配
+        static const Register globalBase = r10;
+        // 合并全局变量块的标号
+        static const char * globalBlockLabel;
+        // 单个变量能进入合并块的最大字节数（小数组）
+        static const int mergeArrayLimit = 256;
+        // 合并块的大小上限，保证偏移在ldr/str的12位立即数范围内
+        static const int mergeBlockLimit = 4096;
+        // 同一个值至少连续重复这么多次才用.fill输出
+        static const std::size_t fillMinRepeat = 3;
+        // 大栈帧中指向帧底的第二个基址寄存器，只有大栈帧保留fp
+        static const Register frameBase = r9;
+        // 可分配的最后一个通用寄存器
+        int lastAllocReg;
+        // 不使用帧基址寄存器时可分配的最后一个通用寄存器
+        int allocLimit;
+        // 当前函数是否使用帧基址寄存器
+        bool useFrameBase;
+        // 当前函数是否要载入合并全局变量块的基址
+        bool curFuncLoadGlobalBase;
+        // 被溢出的临时变量所在的帧槽
+        std::map<std::string, int> spillSlots;
+        // 已经释放、可以复用的溢出槽
+        std::vector<int> freeSpillSlots;
+        // 当前函数用到的溢出槽数量
+        int spillSlotCount;
+        // 当前调用中尚未生成的实参
+        struct PendingArg {
+            Var * var;
+            int num;
+            bool lastUse;
+        };
+        std::vector<PendingArg> pendingArgs;
+        // 常驻在寄存器中的标量局部变量和参数
+        std::map<std::string, Register> homeRegs;
+        // 至少留给临时变量使用的寄存器数
+        static const int minScratchRegs = 6;
+        // 引用权重不低于这个值的变量才常驻寄存器
+        static const std::size_t homeMinWeight = 2;
+        // 当前函数用到的寄存器，用于决定要保存哪些被调用者保存寄存器
+        unsigned int usedRegs;
+        // 当前函数是否调用了其他函数，叶函数不必保存lr
+        bool hasCall;
+        // 出参区的大小，存放调用时第5个起的实参
+        int outgoingSize;
+        // 序言中sp减去的字节数
+        int frameTotal;
+        // 生成函数体时输出先写入缓冲区，函数结束时补上序言再写入文件
+        bool buffering = false;
+        std::string body;
+        // 被合并的全局变量在块中的偏移
+        std::map<std::string, int> globalOffsets;
+        // 向量临时变量所在的q寄存器；只用调用者保存的q0-q3和q8-q14，q15留作临时
+        std::map<std::string, int> vectorRegs;
+        unsigned int freeVectorRegs;
+        static const unsigned int allocVectorRegs = 0x7f0f;
+        static const int vectorScratch = 15;
+        // 各lane的下标常量 {0, 1, 2, 3} 的标号
+        static const char * laneIndexLabel;
+        bool usesLaneIndex;
+
         // 符号表
         std::shared_ptr<Context> ctx;
+        // 判断全局变量是否位于合并块中
+        bool isMergedGlobal(Var * var);
+        // 计算 dst = base + imm，imm无法编码时拆成两条add
+        void emitAddImm(const char * dst, const char * base, int imm);
         // 获得偏移值
         int getOffset(Var * var);
+        // 局部变量槽的访存操作数，fp和帧基址寄存器都够不到时经r12
+        std::string frameSlot(Var * var);
+        // 计算栈上局部数组的地址
+        void emitFrameAddress(Register reg, Var * var);
+        // 溢出槽的访存操作数
+        std::string spillSlot(int slot);
+        // 把寄存器中的临时变量写入它的溢出槽
+        void spillTemp(Register reg);
+        // 函数体生成完毕后输出序言
+        void generatePrologue(std::string curFunc, int frameSize);
+        // 输出汇编，生成函数体时写入缓冲区
+        void print(const char * format, ...);
+        // 变量的常驻寄存器，没有时返回-1
+        int homeRegFor(Var * var);
+        // 为当前函数挑选常驻寄存器的变量
+        void assignHomeRegs(std::string curFunc);
+        // 需要保存的寄存器列表，返回地址用link（push时为lr，pop时为pc）
+        std::string savedRegList(const char * link);
+        // 保存的寄存器占用的字节数
+        int savedRegSize();
+        // var是否是本次调用的实参且调用后不再使用
+        bool isDyingArg(Var * var);
+        // 同时执行一组寄存器间的move
+        void emitParallelMoves(std::vector<std::pair<Register, Register>> moves);
+        // 把记录下的实参放到r0-r3和栈上
+        void lowerCallArgs();
         // 比较两变量是否相同
         bool varsAreSame(Var * var1, Var * var2);
         // 找到存放var的寄存器
@@ -63,12 +154,21 @@ namespace kisyshot::ast {
         void fillReg(Var * src, Register reg);
         // 将寄存器reg中的数据存放到dst中
         void spillReg(Var * dst, Register reg);
+        // 向量临时变量的q寄存器，定值时分配
+        int vectorRegFor(Var * var);
+        // vld1/vst1的寄存器列表
+        std::string vectorRegList(int q);
+        // 输出一个全局变量的标号和初始数据
+        void generateGlobalData(const std::shared_ptr<syntax::VarDefinition> &def);
+        // 全局变量所在的段
+        const char * globalSection(const std::shared_ptr<syntax::VarDefinition> &def);
+        // 输出共total个元素的初始数据，未记录的零用.zero补齐
+        void generateValues(const std::vector<syntax::ValueRun> &values, std::size_t total);
 
     public:
         // 将寄存器映射至变量
         std::map<Register, Var *> regDescriptor;
         FILE * fp;
-        std::vector<Var *> stack;
         int curFuncFrameSize;
         std::string curFuncLabel;
         Arms(const std::shared_ptr<Context> &context);
@@ -82,11 +182,19 @@ namespace kisyshot::ast {
         void generateGOTO(std::string label);
         void generateIfZ(Var * test, std::string label);
         void generateCMP(TokenType opType, Var * src_1, Var * src_2, std::string label);
-        void generateBeginFunc(std::string curFunc, int frameSize);
+        void generateBeginFunc(std::string curFunc, int frameSize, bool loadGlobalBase);
+        // 函数体中是否访问了合并块里的全局变量
+        bool usesMergedGlobal(Instruction * tac);
         void generateEndFunc(std::string curFunc, int frameSize);
         void generateReturn(Var * result);
-        void generateParam(Var * arg, int num, int frame);
+        void generateParam(Var * arg, int num, bool lastUse);
         void generateCall(int numVars, std::string label, Var * result, int paramNum);
+        void generateVectorLoad(Var * dst, Var * src, Var * offset);
+        void generateVectorStore(Var * dst, Var * offset, Var * src);
+        void generateVectorOP(VectorOp::OpCode op, Var * dst, Var * src_1, Var * src_2);
+        void generateVectorDup(Var * dst, Var * src);
+        void generateVectorIndex(Var * dst, Var * src);
+        void generateVectorSum(Var * dst, Var * src);
         void generateHeaders();
         void generateGlobal();
         void generateEnders();
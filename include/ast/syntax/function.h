@@ -1,5 +1,6 @@
 #pragma once
 
+#include <set>
 #include "var_declaration.h"
 #include "statement.h"
 #include "type.h"
@@ -22,5 +23,8 @@ namespace kisyshot::ast::syntax {
         std::size_t lParenIndex = invalidTokenIndex;
         std::size_t rParenIndex = invalidTokenIndex;
         std::size_t stackSize = 0;
+        std::vector<std::shared_ptr<VarDefinition>> locals;     //函数体中定义的局部变量，按定义顺序
+        std::set<std::string> callees;                          //函数体中直接调用的函数
+        bool reentrant = true;                                  //调用图中能否从自身再次到达
     };
 }
\ No newline at end of file
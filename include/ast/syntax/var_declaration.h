@@ -8,6 +8,12 @@
 //TODO::思考一下中间代码生成中变量声明的处理方法
 
 namespace kisyshot::ast::syntax {
+    //从index开始的一段连续非零初始值，其余元素为0
+    struct ValueRun {
+        std::size_t index;
+        std::vector<int> values;
+    };
+
     class VarDefinition:public SyntaxNode, public ISyntaxList<Expression>{
     public:
         void add(const std::shared_ptr<Expression> &child) override;
@@ -19,19 +25,34 @@ namespace kisyshot::ast::syntax {
         std::size_t start() override;
         std::size_t end() override;
         void genCode(compiler::CodeGenerator &gen,ast::Var* temp) override;
+        //按下标递增的顺序记录一个常量初始值
+        void addValue(std::size_t index, int value);
 
         std::shared_ptr<Type> type = nullptr;
         std::shared_ptr<Identifier> varName = nullptr;
         std::shared_ptr<Expression> initialValue = nullptr;
         std::vector<std::shared_ptr<Expression>> dimensionDef;   //这里保存维度信息
-        std::vector<std::shared_ptr<Expression>> srcArray;
+        std::vector<std::pair<std::size_t, std::shared_ptr<Expression>>> srcArray;  //显式给出的元素及其下标，未给出的为0
         std::vector<int> dimension;                              //这里保存check后的维度信息
         std::vector<int> accumulation;                           //这里保存累积维度
-        std::vector<int> values;
+        std::vector<ValueRun> values;                            //常量初始值，只保存非零的部分
+        std::string initLabel;                                   //常量初始化模板的标号，为空表示逐个元素初始化
+        std::string staticLabel;                                 //静态分配在.bss中的标号，为空表示在栈上
         std::size_t equalTokenIndex = invalidTokenIndex;
         std::size_t offset;
+        std::size_t accessWeight = 0;                            //按循环嵌套加权的引用次数，用于栈帧布局
         std::size_t width;
-        bool isConst;
+        bool isConst = false;
+
+        //非零常量元素不少于这个数且占一半以上时，从.rodata模板整体复制
+        static const std::size_t templateMinElements = 16;
+        //零元素不少于这个数时，先整体清零再只写非零元素
+        static const std::size_t bulkZeroMinElements = 8;
+        //不可重入函数中不小于这个字节数的局部数组静态分配
+        static const std::size_t staticMinBytes = 1024;
+    private:
+        //局部数组的初始化
+        void genArrayInit(compiler::CodeGenerator &gen, ast::Var* array);
     };
     class VarDeclaration:public Statement, public ISyntaxList<VarDefinition>{
 
@@ -34,6 +34,7 @@ namespace kisyshot::ast {
         VarType type;
         bool isArray = false;  //如果是数组，在初始化类Var的时候设置isArray为true。
         bool isParam = false; //形参
+        bool isVector = false; //向量临时变量，存放4个连续的int
 
         //传入一个变量名建立一个Var对象，需要判断是否是全局变量
         Var(std::string variableName);
@@ -63,7 +64,8 @@ namespace kisyshot::ast {
         Return_,
         BeginFunc_,
         EndFunc_,
-        CMP_
+        CMP_,
+        Vector_
     };
 
     class Instruction {
@@ -98,8 +100,9 @@ namespace kisyshot::ast {
 
     class Binary_op : Instruction{
     public:
-        static const int NumOps = 11;
-        typedef enum {Add,Sub,Mul,Div,Mod,Less,Greater,Equaleq,Exclaimeq,Greatereq,Lesseq} OpCode; //后面是关系表达式
+        static const int NumOps = 13;
+        //Less到Lesseq是关系表达式；And和Shr只由优化生成：按位与、算术右移
+        typedef enum {Add,Sub,Mul,Div,Mod,Less,Greater,Equaleq,Exclaimeq,Greatereq,Lesseq,And,Shr} OpCode;
         static std::string opName[NumOps]; //每一个索引对应的运算符号
         //返回名字对应的code
         static OpCode opCodeForName(std::string &name);
@@ -209,4 +212,21 @@ namespace kisyshot::ast {
         InstructionType getType() override;
     };
 
+    class VectorOp : Instruction {
+        //NEON向量指令，一次处理4个int
+        //Load、Store的操作数与Load、Store指令相同，Add、Sub、Mul与Binary_op相同；
+        //Dup把标量复制到4个lane，Index得到 {x, x+1, x+2, x+3}，Sum把4个lane相加得到标量，
+        //这三种与Assign一样src_2是目的操作数
+    public:
+        static const int NumOps = 8;
+        typedef enum {Load, Store, Add, Sub, Mul, Dup, Index, Sum} OpCode;
+        static std::string opName[NumOps];
+        std::string toString() override;
+        InstructionType getType() override;
+
+        OpCode code;
+        VectorOp(OpCode c, Var *src_1, Var *src_2, Var *dst);
+        VectorOp(OpCode c, Var *src, Var *dst);
+    };
+
 }
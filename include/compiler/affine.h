@@ -0,0 +1,40 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// 数组下标的仿射形式，向量化和循环交换的依赖分析共用
+namespace kisyshot::compiler {
+    // 下标的仿射形式 c + Σ coef·atom + iv·i，atom是循环中不变的标量变量；
+    // 其他不随i变化的值用一个#开头的名字代表，它们无法在循环外重新算出
+    struct Affine {
+        std::map<std::string, int64_t> terms;
+        int64_t c = 0;
+        int64_t iv = 0;
+        bool ok = true;
+    };
+
+    inline Affine combine(const Affine &a, const Affine &b, int64_t sign) {
+        Affine r = a;
+        for (auto &[name, coef] : b.terms)
+            if ((r.terms[name] += sign * coef) == 0)
+                r.terms.erase(name);
+        r.c += sign * b.c;
+        r.iv += sign * b.iv;
+        return r;
+    }
+
+    inline Affine scaled(Affine a, int64_t k) {
+        for (auto &[name, coef] : a.terms)
+            coef *= k;
+        a.c *= k;
+        a.iv *= k;
+        if (k == 0)
+            a.terms.clear();
+        return a;
+    }
+}
+
+#endif
@@ -11,6 +11,8 @@ namespace kisyshot::compiler {
         std::string curFucLabel;
         int frameSize;
         int paramNum;
+        // 当前函数是否需要载入合并全局变量块的基址
+        bool loadGlobalBase;
         std::shared_ptr<Context> ctx;
         // 三地址码指令序列
         std::list<Instruction *> code;
@@ -20,6 +22,8 @@ namespace kisyshot::compiler {
         // 活跃变量表，将每个临时变量映射到最后一次使用该变量的指令
         std::list<std::map<Var *, Instruction *> > liveList;
         std::list<std::map<Var *, Instruction *> >::iterator liveListIterator;
+        // 最后一次使用是作为实参的临时变量，在call之后才释放
+        std::vector<Var *> argDiscards;
     public:
         ArmCodeGenerator(std::list<Instruction *> &tacCode, const std::shared_ptr<Context> &context);
         void generateSpecial(Instruction * tac, Arms &arms);
@@ -0,0 +1,213 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "codegen.h"
+#include "../context.h"
+
+// 三地址码优化，在生成arm汇编之前改写CodeGenerator中的指令序列
+namespace kisyshot::compiler {
+    // 基本块：块首至多一个标号，只有最后一条指令可能是跳转
+    struct BasicBlock {
+        std::string label;
+        std::list<ast::Instruction *> code;
+        std::vector<BasicBlock *> succs;
+        std::vector<BasicBlock *> preds;
+        // 在函数中的顺序号
+        int index;
+    };
+
+    // 一个函数的基本块，按代码顺序排列；没有以GOTO结尾的块落入下一个块
+    struct FunctionBody {
+        std::string name;
+        std::vector<BasicBlock *> blocks;
+        std::map<std::string, BasicBlock *> labels;
+        // 各块的直接支配者的顺序号，入口块是自己，不可达的块为-1
+        std::vector<int> idom;
+        std::vector<bool> reachable;
+    };
+
+    // 自然循环：header是唯一的入口，latch以GOTO回到header，有多条回边时latch为空
+    struct Loop {
+        BasicBlock * header;
+        BasicBlock * latch;
+        std::set<BasicBlock *> blocks;
+    };
+
+    // 计数循环：块h..l在代码中连续，header以 iv cont bound 不成立离开循环，latch中以 iv = iv ± step 更新
+    struct CountedLoop {
+        int h, l;
+        ast::Instruction * test;
+        ast::Var * iv;
+        int64_t step;
+        ast::TokenType cont;
+        ast::Var * bound;
+        // 更新归纳变量的指令：iv = iv ± c，或者 t = iv ± c 和 iv = t 两条
+        ast::Instruction * inc;
+        ast::Instruction * ivDef;
+        // 循环体（不含header和回到header的GOTO）的指令数
+        int bodySize;
+        bool hasCall;
+        // 循环中各变量的定值次数
+        std::map<ast::Var *, int> defs;
+    };
+
+    // 归约：循环中 s 只被 t = s op x; s = t 读写，op为 + - *，减法时 s 在左边
+    struct Reduction {
+        ast::Var * var;
+        ast::Binary_op::OpCode op;
+        // t = s op x，直接写成 s = s op x 时和def是同一条指令
+        ast::Instruction * update;
+        ast::Instruction * def;
+    };
+
+    // 临时变量的定值次数、使用次数和使用它的块
+    struct TempInfo {
+        int defs = 0;
+        int uses = 0;
+        std::set<BasicBlock *> blocks;
+    };
+
+    // 优化前的函数体：指令的副本和各标号对应的下标，供编译期求值解释执行
+    struct SavedBody {
+        std::vector<ast::Instruction *> code;
+        std::map<std::string, int> labels;
+    };
+
+    class Optimizer {
+    private:
+        CodeGenerator &gen;
+        std::shared_ptr<Context> ctx;
+        // 部分展开的倍数
+        static const int unrollFactor = 4;
+        // 循环体不超过这么多条指令才部分展开
+        static const int unrollMaxBody = 40;
+        // 完全展开的最大迭代次数
+        static const int fullUnrollMaxTrip = 32;
+        // 完全展开后不超过这么多条指令
+        static const int fullUnrollMaxSize = 320;
+        // 向量化时一个向量的int个数
+        static const int vectorWidth = 4;
+        // 向量循环体中同时活跃的向量数的上限
+        static const int vectorMaxLive = 8;
+        // 一个函数中因拆分循环最多复制这么多条指令
+        static const int unswitchMaxGrowth = 160;
+        // 部分展开时一个乘法归约拆成的部分积个数（含原变量），它们都要占用局部变量的寄存器
+        static const int reductionAccumulators = 2;
+        // 跳转穿线时复制到前驱的指令数上限，以及一个函数中复制的总数上限
+        static const int threadMaxCopy = 8;
+        static const int threadMaxGrowth = 64;
+        // 值域分析中循环头的入口被更新超过这么多次后，变大的区间端点直接放宽到int的边界
+        static const int rangeWidenAfter = 2;
+        // 编译期求值：一次调用最多解释执行的指令数、整个程序的总数，局部数组的int个数和调用深度的上限
+        static const int evalMaxSteps = 1 << 20;
+        static const int evalMaxTotalSteps = 1 << 23;
+        static const int evalMaxCells = 1 << 16;
+        static const int evalMaxDepth = 256;
+        // 已经新建的局部变量个数，用来生成不重复的名字
+        int localCount = 0;
+        // 各函数优化前的代码，其中不读写全局变量、不做输入输出的函数，以及求过值的调用
+        std::map<std::string, SavedBody> bodies;
+        std::set<std::string> pureFunctions;
+        std::map<std::pair<std::string, std::vector<int64_t>>, int64_t> evaluated;
+        std::set<std::pair<std::string, std::vector<int64_t>>> unevaluable;
+        int64_t evalBudget = evalMaxTotalSteps;
+
+        // 把一个函数的指令切分为基本块
+        void buildBlocks(FunctionBody &fn, std::list<ast::Instruction *> &code);
+        // 根据跳转和代码顺序连接前驱后继，并计算支配关系
+        void buildCFG(FunctionBody &fn);
+        // 按块的顺序输出指令
+        std::list<ast::Instruction *> linearize(FunctionBody &fn);
+        // 块的代码被改写后重新切分基本块
+        void rebuild(FunctionBody &fn);
+        // 块d支配块b
+        bool dominates(FunctionBody &fn, BasicBlock * d, BasicBlock * b);
+        // 找出所有自然循环，内层循环在前
+        std::vector<Loop> findLoops(FunctionBody &fn);
+        // 按顺序对loops中互不相邻的循环调用transform，一遍结束后只重建一次，有循环被改写时返回true
+        bool sweepLoops(FunctionBody &fn, std::vector<Loop> loops, const std::function<bool(Loop &)> &transform);
+        // 识别计数循环，不是时返回false
+        bool matchCountedLoop(FunctionBody &fn, Loop &loop, CountedLoop &info);
+        // 找出计数循环中的归约变量
+        std::vector<Reduction> matchReductions(FunctionBody &fn, CountedLoop &info);
+
+        // 把关系表达式生成的"比较-赋0/1-判零"合并为一条条件跳转
+        void fuseCompareBranches(std::list<ast::Instruction *> &code);
+        // 代数化简：块内合并常量链、套用代数恒等式、化简和常量的比较
+        bool combineInstructions(FunctionBody &fn);
+        bool combineBlock(BasicBlock * block, bool &branched);
+        // 交换完美嵌套的两层计数循环，让最内层的数组访问尽量连续
+        bool interchangeLoops(FunctionBody &fn);
+        bool interchangeLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done);
+        // 从块start开始的某条路径上var在重新定值之前被使用
+        bool usedBeforeDef(FunctionBody &fn, BasicBlock * start, ast::Var * var);
+        // 把循环中不变的条件跳转提到循环前面，按两个结果各复制一份循环
+        bool unswitchLoops(FunctionBody &fn);
+        bool unswitchLoop(FunctionBody &fn, Loop &loop, int &budget);
+        // 循环中的全局变量和下标不变的数组元素放进局部变量，循环前读入、离开时写回
+        bool promoteLoops(FunctionBody &fn);
+        bool promoteLoop(FunctionBody &fn, Loop &loop, std::map<BasicBlock *, int> &depth, std::set<std::string> &done);
+        // 部分冗余消除：先消除块内的重复运算，再用惰性代码移动在边上补上缺少的运算、删去冗余的运算
+        bool eliminatePartialRedundancy(FunctionBody &fn);
+        bool eliminateLocalRedundancy(FunctionBody &fn);
+        bool lazyCodeMotion(FunctionBody &fn);
+        // 复制传播：临时变量的使用换成复制的源，只被复制一次的运算结果直接写进复制的目标
+        bool propagateCopies(FunctionBody &fn);
+        std::map<std::string, TempInfo> collectTemps(FunctionBody &fn);
+        bool forwardCopy(BasicBlock * block, std::list<ast::Instruction *>::iterator copy,
+                         std::map<std::string, TempInfo> &temps);
+        bool coalesceCopy(BasicBlock * block, std::list<ast::Instruction *>::iterator copy,
+                          std::map<std::string, TempInfo> &temps);
+        // 值域分析：按变量的取值区间确定条件跳转的结果，非负数的除2^k和模2^k改成移位和按位与
+        bool simplifyWithRanges(FunctionBody &fn);
+        // 编译期求值：纯函数的参数都是常量时解释执行它优化前的代码，调用换成返回值
+        void collectPureFunctions();
+        bool evaluateCalls(FunctionBody &fn);
+        bool interpret(const std::string &fun, const std::vector<int64_t> &args, int64_t &result,
+                       int64_t &steps, int64_t &cells, int depth);
+        // 前驱中条件跳转的结果已经确定时，前驱直接跳到确定的后继
+        bool threadJumps(FunctionBody &fn);
+        bool threadJump(FunctionBody &fn, BasicBlock * pred, int &budget, std::set<BasicBlock *> &touched);
+        // 删除走不到的块、穿过空块和GOTO直接跳到最终目标、删去多余的跳转和没有引用的标号
+        bool simplifyCFG(FunctionBody &fn);
+        bool removeUnreachableBlocks(FunctionBody &fn);
+        bool threadBranches(FunctionBody &fn);
+        bool removeRedundantBranches(FunctionBody &fn);
+        bool removeUnusedLabels(FunctionBody &fn);
+        // 删除结果不再使用的运算、赋值和读取，以及对不会被读的局部数组的写
+        bool eliminateDeadCode(FunctionBody &fn);
+        bool eliminateDeadDefs(FunctionBody &fn);
+        bool eliminateDeadStores(FunctionBody &fn);
+        // 用NEON指令一次执行4次迭代
+        bool vectorizeLoops(FunctionBody &fn);
+        bool vectorizeLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done);
+        // 展开计数循环
+        bool unrollLoops(FunctionBody &fn);
+        bool unrollLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done);
+        // 把循环的测试移到底部，循环前复制一份测试作为保护
+        bool rotateLoops(FunctionBody &fn);
+        bool rotateLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done);
+        // 完全展开后的一份循环体中归纳变量的值已知，代入并折叠常量
+        void foldInductionCopy(std::vector<BasicBlock *> &copy, ast::Var * iv, int64_t value);
+
+        // 复制一条指令，temps中的临时变量和labels中的标号换成新的
+        ast::Instruction * cloneInstruction(ast::Instruction * ins, std::map<ast::Var *, ast::Var *> &temps,
+                                            std::map<std::string, std::string> &labels);
+        // 复制一段基本块，块内的临时变量和标号都换成新的
+        std::vector<BasicBlock *> cloneBlocks(const std::vector<BasicBlock *> &blocks);
+        // 在函数的栈帧中新建一个和like同类的标量局部变量，like是临时变量时新建一个int局部变量
+        ast::Var * newLocal(FunctionBody &fn, ast::Var * like, std::size_t weight);
+
+    public:
+        Optimizer(CodeGenerator &generator, const std::shared_ptr<Context> &context);
+        void optimize();
+    };
+}
+
+#endif
@@ -16,9 +16,16 @@ namespace kisyshot::compiler{
         void traverseStatement(const std::shared_ptr<ast::syntax::Statement>& stmt);
         void newVariable(const std::shared_ptr<ast::syntax::VarDefinition>& def);
         void prepareArrayDef(const std::shared_ptr<ast::syntax::VarDefinition>& def);
+        // registers a .rodata copy of a dense constant local array initializer
+        void prepareInitTemplate(const std::shared_ptr<ast::syntax::VarDefinition>& def);
 
         std::pair<int, bool> checkCompileTimeConstExpr(const std::shared_ptr<ast::syntax::Expression>& expr);
-        void flattenArray(const std::shared_ptr<ast::syntax::VarDefinition>& def,const std::shared_ptr<ast::syntax::ArrayInitializeExpression> &init, size_t target, size_t dim = 0);
+        // marks the functions that can not reach themselves in the call graph
+        void markReentrantFunctions();
+        // assigns frame offsets to the locals of func, large arrays of
+        // non-reentrant functions are moved to .bss
+        void layoutFrame(const std::shared_ptr<ast::syntax::Function>& func);
+        void flattenArray(const std::shared_ptr<ast::syntax::VarDefinition>& def,const std::shared_ptr<ast::syntax::ArrayInitializeExpression> &init, size_t start, size_t target, size_t dim = 0);
         // copy of the context
         std::shared_ptr<Context> _context;
         // copy of the diagnostic info collector
@@ -31,5 +38,10 @@ namespace kisyshot::compiler{
         std::vector<std::string> _layerNames;
         std::string _blockName;
         std::size_t _blockId = 0;
+        // nesting depth of while loops around the current statement
+        std::size_t _loopDepth = 0;
+        // scope of every local as [definition point, block exit point]
+        std::unordered_map<ast::syntax::VarDefinition*, std::pair<std::size_t, std::size_t>> _scopes;
+        std::size_t _scopePoint = 0;
     };
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef TAC_UTILS_H
+#define TAC_UTILS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../ast/tac.h"
+
+// 优化各趟共用的三地址码查询函数
+namespace kisyshot::compiler {
+    inline bool isBranch(ast::Instruction * ins) {
+        auto type = ins->getType();
+        return type == ast::InstructionType::GOTO_ || type == ast::InstructionType::IfZ_ ||
+               type == ast::InstructionType::CMP_;
+    }
+
+    // 跳转指令的目标标号
+    inline std::string &branchLabel(ast::Instruction * ins) {
+        switch (ins->getType()) {
+            case ast::InstructionType::GOTO_:
+                return ((ast::GOTO *)ins)->label;
+            case ast::InstructionType::IfZ_:
+                return ((ast::IfZ *)ins)->trueLabel;
+            default:
+                return ((ast::CMP *)ins)->label;
+        }
+    }
+
+    // 指令读取的操作数所在的位置，可以就地替换
+    inline std::vector<ast::Var **> useSlots(ast::Instruction * ins) {
+        switch (ins->getType()) {
+            case ast::InstructionType::Binary_op_:
+            case ast::InstructionType::Load_:
+            case ast::InstructionType::CMP_:
+                return {&ins->src_1, &ins->src_2};
+            case ast::InstructionType::Store_:
+                return {&ins->src_1, &ins->src_2, &ins->dst};
+            case ast::InstructionType::Assign_:
+            case ast::InstructionType::Param_:
+            case ast::InstructionType::IfZ_:
+                return {&ins->src_1};
+            case ast::InstructionType::Return_:
+                if (ins->numVars == 1)
+                    return {&ins->src_1};
+                return {};
+            case ast::InstructionType::Vector_:
+                if (((ast::VectorOp *)ins)->code == ast::VectorOp::Store)
+                    return {&ins->src_1, &ins->src_2, &ins->dst};
+                if (ins->numVars == 2)
+                    return {&ins->src_1};
+                return {&ins->src_1, &ins->src_2};
+            default:
+                return {};
+        }
+    }
+
+    // 指令定值的变量所在的位置，可以就地替换；没有时返回nullptr
+    inline ast::Var ** defSlot(ast::Instruction * ins) {
+        switch (ins->getType()) {
+            case ast::InstructionType::Binary_op_:
+            case ast::InstructionType::Load_:
+                return &ins->dst;
+            case ast::InstructionType::Assign_:
+                return &ins->src_2;
+            case ast::InstructionType::Call_:
+                return ins->numVars == 1 ? &ins->src_1 : nullptr;
+            case ast::InstructionType::Vector_:
+                if (((ast::VectorOp *)ins)->code == ast::VectorOp::Store)
+                    return nullptr;
+                return ins->numVars == 2 ? &ins->src_2 : &ins->dst;
+            default:
+                return nullptr;
+        }
+    }
+
+    // 指令定值的变量，没有时返回nullptr
+    inline ast::Var * defOf(ast::Instruction * ins) {
+        ast::Var ** slot = defSlot(ins);
+        return slot == nullptr ? nullptr : *slot;
+    }
+
+    inline bool sameVar(ast::Var * a, ast::Var * b) {
+        if (a == b)
+            return true;
+        if (a == nullptr || b == nullptr || a->type != b->type)
+            return false;
+        return a->getName() == b->getName();
+    }
+
+    // 不是数组的局部变量（包括参数）
+    inline bool isScalarLocal(ast::Var * var) {
+        return var->type == ast::VarType::LocalVar && !var->isArray;
+    }
+
+    // 形参数组可能指向任何数组，其余名字不同的数组互不重叠；全局变量的isParam也为true，要按类型区分
+    inline bool mayAlias(ast::Var * a, ast::Var * b) {
+        auto isParam = [](ast::Var * var) {
+            return var->isParam && var->type == ast::VarType::LocalVar;
+        };
+        return sameVar(a, b) || isParam(a) || isParam(b);
+    }
+
+    // a op b 取反后的关系
+    inline ast::TokenType invertRelation(ast::TokenType op) {
+        switch (op) {
+            case ast::TokenType::op_less: return ast::TokenType::op_greatereq;
+            case ast::TokenType::op_greatereq: return ast::TokenType::op_less;
+            case ast::TokenType::op_greater: return ast::TokenType::op_lesseq;
+            case ast::TokenType::op_lesseq: return ast::TokenType::op_greater;
+            case ast::TokenType::op_equaleq: return ast::TokenType::op_exclaimeq;
+            default: return ast::TokenType::op_equaleq;
+        }
+    }
+
+    // 交换两个操作数后的关系：a op b 等价于 b swap(op) a
+    inline ast::TokenType swapRelation(ast::TokenType op) {
+        switch (op) {
+            case ast::TokenType::op_less: return ast::TokenType::op_greater;
+            case ast::TokenType::op_greater: return ast::TokenType::op_less;
+            case ast::TokenType::op_lesseq: return ast::TokenType::op_greatereq;
+            case ast::TokenType::op_greatereq: return ast::TokenType::op_lesseq;
+            default: return op;
+        }
+    }
+
+    inline bool evalRelation(ast::TokenType op, int64_t a, int64_t b) {
+        switch (op) {
+            case ast::TokenType::op_less: return a < b;
+            case ast::TokenType::op_greater: return a > b;
+            case ast::TokenType::op_lesseq: return a <= b;
+            case ast::TokenType::op_greatereq: return a >= b;
+            case ast::TokenType::op_equaleq: return a == b;
+            default: return a != b;
+        }
+    }
+
+    // 按32位补码计算常量运算，不能折叠（除零等）时返回false
+    inline bool foldBinary(ast::Binary_op::OpCode op, int64_t a, int64_t b, int64_t &result) {
+        uint32_t x = (uint32_t)a, y = (uint32_t)b;
+        switch (op) {
+            case ast::Binary_op::Add: result = (int32_t)(x + y); return true;
+            case ast::Binary_op::Sub: result = (int32_t)(x - y); return true;
+            case ast::Binary_op::Mul: result = (int32_t)(x * y); return true;
+            case ast::Binary_op::Div:
+                if ((int32_t)y == 0 || ((int32_t)x == INT32_MIN && (int32_t)y == -1))
+                    return false;
+                result = (int32_t)x / (int32_t)y;
+                return true;
+            case ast::Binary_op::Mod:
+                if ((int32_t)y == 0 || ((int32_t)x == INT32_MIN && (int32_t)y == -1))
+                    return false;
+                result = (int32_t)x % (int32_t)y;
+                return true;
+            case ast::Binary_op::And: result = (int32_t)(x & y); return true;
+            case ast::Binary_op::Shr:
+                if (y > 31)
+                    return false;
+                result = (int32_t)x >> y;
+                return true;
+            default:
+                return false;
+        }
+    }
+}
+
+#endif
@@ -14,6 +14,10 @@ namespace kisyshot{
     class Context{
     public:
         std::string target;
+        /**
+         * Whether NEON instructions may be emitted (-mfpu=neon).
+         */
+        bool neon = false;
         /**
          * The path of the given code, used in diagnostic.
          */
@@ -50,6 +54,14 @@ namespace kisyshot{
          * Strings
          */
         std::unordered_map<std::string, std::string> strings;
+        /**
+         * Local arrays whose constant initializer is copied from a .rodata template
+         */
+        std::vector<std::shared_ptr<ast::syntax::VarDefinition>> initTemplates;
+        /**
+         * Large local arrays of non-reentrant functions, allocated in .bss instead of the stack
+         */
+        std::vector<std::shared_ptr<ast::syntax::VarDefinition>> staticLocals;
         /**
          * The index of the current syntax context.
          */
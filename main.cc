@@ -6,19 +6,35 @@
 #include "ast/cfg.h"
 #include "ast/arms.h"
 #include "compiler/armcode.h"
+#include "compiler/optimizer.h"
 
 using namespace kisyshot::ast;
 
 int main(int argc, char* argv[]) {
-    if (argc == 5) {
+    // kisyshot [-mfpu=neon] -S -o out.s in.sy，其余以-开头的选项忽略
+    std::string output, input;
+    bool neon = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else if (arg == "-mfpu=neon")
+            neon = true;
+        else if (arg[0] != '-')
+            input = arg;
+    }
+    if (!output.empty() && !input.empty()) {
         auto sm = std::make_shared<kisyshot::ContextManager>();
-        auto ctx = sm->load(std::string(argv[4]));
-        ctx->target = argv[3];
+        auto ctx = sm->load(input);
+        ctx->target = output;
+        ctx->neon = neon;
         sm->lex(ctx->contextID);
         sm->parse(ctx->contextID);
         sm->check(ctx->contextID);
         kisyshot::compiler::CodeGenerator gen;
         ctx->syntaxTree->genCode(gen, nullptr);
+        kisyshot::compiler::Optimizer optimizer(gen, ctx);
+        optimizer.optimize();
         kisyshot::compiler::ArmCodeGenerator armgen(gen.code, ctx);
         armgen.generateArmCode();
     }
@@ -2,10 +2,110 @@
 #include <ast/arms.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
+#include <algorithm>
+#include <bitset>
 
 using namespace kisyshot::ast;
 
+const char * Arms::globalBlockLabel = ".Lglobals";
+const char * Arms::laneIndexLabel = ".Llane_index";
+
+// 判断imm能否编码为ARM的8位循环移位立即数
+static bool isArmImmediate(unsigned int imm) {
+    for (int rot = 0; rot < 32; rot += 2) {
+        unsigned int v = rot == 0 ? imm : ((imm << rot) | (imm >> (32 - rot)));
+        if (v <= 0xff)
+            return true;
+    }
+    return false;
+}
+
+// 最低的1所在的位，x不为0
+static int trailingZeros(unsigned int x) {
+    int n = 0;
+    while ((x & 1u) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+
+void Arms::print(const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (!buffering) {
+        vfprintf(fp, format, args);
+        va_end(args);
+        return;
+    }
+    // 先求出格式化后的长度，再直接写到缓冲区末尾
+    va_list copy;
+    va_copy(copy, args);
+    int n = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    std::size_t old = body.size();
+    body.resize(old + n + 1);
+    vsnprintf(&body[old], n + 1, format, args);
+    body.resize(old + n);
+    va_end(args);
+}
+
+bool Arms::isMergedGlobal(Var * var) {
+    return var->type == VarType::GlobalVar && globalOffsets.count(var->getName()) != 0;
+}
+
+void Arms::emitAddImm(const char * dst, const char * base, int imm) {
+    // 负数用sub
+    const char * op = imm < 0 ? "sub" : "add";
+    unsigned int rest = imm < 0 ? -(unsigned int)imm : imm;
+    if (isArmImmediate(rest)) {
+        print("\t%s %s, %s, #%u\n", op, dst, base, rest);
+        return;
+    }
+    // 每次取出最低的8位（偶数位对齐）作为一条add的立即数
+    while (rest != 0) {
+        int shift = trailingZeros(rest) & ~1;
+        unsigned int chunk = rest & (0xffu << shift);
+        print("\t%s %s, %s, #%u\n", op, dst, base, chunk);
+        base = dst;
+        rest -= chunk;
+    }
+}
+
+std::string Arms::frameSlot(Var * var) {
+    // 小栈帧不用fp，局部变量区位于出参区之上，直接从sp访问
+    if (!useFrameBase) {
+        int off = outgoingSize + getOffset(var);
+        if (off <= 4095)
+            return "[sp, #" + std::to_string(off) + "]";
+        print("\tmov32I r12, 0x%08x\n", off);
+        return "[sp, r12]";
+    }
+    int dist = curFuncFrameSize - getOffset(var);
+    if (dist <= 4095)
+        return "[fp, #-" + std::to_string(dist) + "]";
+    if (getOffset(var) <= 4095)
+        return "[" + regs[frameBase].name + ", #" + std::to_string(getOffset(var)) + "]";
+    print("\tmov32I r12, 0x%08x\n", getOffset(var) - curFuncFrameSize);
+    return "[fp, r12]";
+}
+
+void Arms::emitFrameAddress(Register reg, Var * var) {
+    if (!useFrameBase) {
+        emitAddImm(regs[reg].name.c_str(), "sp", outgoingSize + getOffset(var));
+        return;
+    }
+    int dist = curFuncFrameSize - getOffset(var);
+    if (isArmImmediate(dist))
+        print("\tadd %s, fp, #-%d\n", regs[reg].name.c_str(), dist);
+    else if (isArmImmediate(getOffset(var)))
+        print("\tadd %s, %s, #%d\n", regs[reg].name.c_str(), regs[frameBase].name.c_str(), getOffset(var));
+    else
+        emitAddImm(regs[reg].name.c_str(), "fp", -dist);
+}
+
 bool Arms::varsAreSame(Var * var1, Var * var2) {
     return (var1 == var2 || (var1 && var2 && (var1->getName() == var2->getName()) && (var1->getBase() == var2->getBase()) && getOffset(var1) == getOffset(var2)));
 }
@@ -15,6 +115,9 @@ int Arms::getOffset(Var * var) {
 }
 
 int Arms::findRegForVar(Var * var) {
+    int home = homeRegFor(var);
+    if (home != -1)
+        return home;
     std::map<Register, Var *>::iterator it;
     Register reg = (Register)r0;
     bool flag = false;
@@ -33,7 +136,7 @@ int Arms::findRegForVar(Var * var) {
 
 int Arms::findCleanReg() {
     int index = -1;
-    for (int i = r0; i <= r10; i++) {
+    for (int i = r0; i <= lastAllocReg; i++) {
         if ((regs[i].isDirty == false) && (regs[i].mutexLock == false)) {
             index = i;
             break;
@@ -43,6 +146,7 @@ int Arms::findCleanReg() {
         index = selectRandomReg();
         cleanReg((Register)index);
     }
+    usedRegs |= 1u << index;
 
     return index;
 }
@@ -51,18 +155,15 @@ int Arms::selectRandomReg() {
     bool flag = false;
     int select = 0;
     while (!flag) {
-        select = rand() % 11;
+        select = rand() % (lastAllocReg + 1);
         if (regs[select].mutexLock == false) {
             if (getRegContents((Register)select) != NULL) {
                 if (getRegContents((Register)select)->type == VarType::GlobalVar)
-                    spillReg(getRegContents((Register)select), (Register)select);
+                    cleanReg((Register)select);
                 else if (getRegContents((Register)select)->type == VarType::LocalVar)
-                    spillReg(getRegContents((Register)select), (Register)select);
-                else if (getRegContents((Register)select)->type == VarType::TempVar) {
-                    stack.push_back(getRegContents((Register)select));
-                    fprintf(fp, "\tpush {%s}\n", regs[select].name.c_str());
-                    spillReg(getRegContents((Register)select), (Register)select);
-                }
+                    cleanReg((Register)select);
+                else if (getRegContents((Register)select)->type == VarType::TempVar)
+                    spillTemp((Register)select);
             }
             flag = true;
         }
@@ -89,7 +190,11 @@ Var * Arms::getRegContents(Register reg) {
 
 void Arms::cleanReg(Register reg) {
     Var * var = getRegContents(reg);
-    if (var != NULL)
+    // 局部和全局变量每次定值后都立即写回，寄存器中只是内存的副本，直接丢弃即可；
+    // 再写回一次不但多余，而且槽被作用域不相交的变量共享后会覆盖新的值
+    if (var != NULL && (var->type == VarType::LocalVar || var->type == VarType::GlobalVar))
+        regDescriptorRemove(var, reg);
+    else if (var != NULL)
         spillReg(var, reg);
     regs[reg].isDirty = false;
 }
@@ -106,17 +211,17 @@ void Arms::cleanRegForBranch() {
 }
 
 void Arms::cleanRegForCall() {
-    for (int i = r0; i <= r10; i++)
-        if (regs[i].isDirty == true)
-            if (getRegContents((Register)i) != NULL) {
-                if (getRegContents((Register)i)->type != VarType::TempVar)
-                    spillReg(getRegContents((Register)i), (Register)i);
-                else {
-                    stack.push_back(getRegContents((Register)i));
-                    fprintf(fp, "\tpush {%s}\n", regs[i].name.c_str());
-                    regDescriptorRemove(getRegContents((Register)i), (Register)i);
-            }
-        }
+    // r4以上的寄存器由被调用者保存，只有r0-r3会被破坏；
+    // 全局变量可能被被调用者修改，寄存器中的副本一律作废
+    for (int i = r0; i <= r10; i++) {
+        Var * var = getRegContents((Register)i);
+        if (var == NULL)
+            continue;
+        if (var->type == VarType::GlobalVar)
+            cleanReg((Register)i);
+        else if (i <= r3 && var->type == VarType::TempVar && regs[i].isDirty && !isDyingArg(var))
+            spillTemp((Register)i);
+    }
 }
 
 void Arms::cleanRegForEndFunc() {
@@ -145,6 +250,9 @@ std::map<Arms::Register, Var *>::iterator Arms::regDescriptorFind(Var * var) {
 }
 
 void Arms::regDescriptorInsert(Var * var, Register reg, bool dirty = true) {
+    // 常驻寄存器的变量不进入寄存器描述符
+    if (homeRegFor(var) != -1)
+        return;
     if (regDescriptor.find((Register)reg) != regDescriptor.end())
         regDescriptor[reg] = var;
     else 
@@ -159,6 +267,8 @@ void Arms::regDescriptorRemove(Var * var, Register reg) {
 }
 
 void Arms::discardVarInReg(Var * var, Register reg) {
+        if (homeRegFor(var) != -1)
+            return;
         regDescriptorRemove(var, reg);
         regs[reg].isDirty = false;
         regs[reg].canDiscard = false;
@@ -166,90 +276,110 @@ void Arms::discardVarInReg(Var * var, Register reg) {
 
 void Arms::fillReg(Var * src, Register reg) {
     Register preReg = (Register)findRegForVar(src);
+    if (homeRegFor(src) != -1) {
+        if (reg != preReg)
+            print("\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
+        return;
+    }
     if (src->type == VarType::StringVar) {
-        fprintf(fp, "\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());
+        print("\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());
     }
     if (src->type == VarType::GlobalVar) {
-        if ((int)preReg == -1)
+        if ((int)preReg == -1 && isMergedGlobal(src)) {
             if (src->isArray)
-                fprintf(fp, "\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());  
+                emitAddImm(regs[reg].name.c_str(), regs[globalBase].name.c_str(), globalOffsets[src->getName()]);
+            else
+                print("\tldr %s, [%s, #%d]\n", regs[reg].name.c_str(), regs[globalBase].name.c_str(), globalOffsets[src->getName()]);
+        }
+        else if ((int)preReg == -1)
+            if (src->isArray)
+                print("\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());  
             else {
-                fprintf(fp, "\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());
-                fprintf(fp, "\tldr %s, [%s]\n", regs[reg].name.c_str(), regs[reg].name.c_str());
+                print("\tmov32I %s, %s\n", regs[reg].name.c_str(), src->getName().c_str());
+                print("\tldr %s, [%s]\n", regs[reg].name.c_str(), regs[reg].name.c_str());
             }
         else if (reg != preReg)
-            fprintf(fp, "\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
+            print("\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
     }
     if (src->type == VarType::LocalVar) {
         if ((int)preReg == -1)
-            if (src->isArray) {
-                if (src->isParam) {
-                    if (curFuncFrameSize - getOffset(src) > 4095) {
-                        fprintf(fp, "\tmov32I r12, 0x%08x\n", getOffset(src) - curFuncFrameSize);
-                        fprintf(fp, "\tldr %s, [fp, r12]\n", regs[reg].name.c_str());
-                    }
-                    else
-                        fprintf(fp, "\tldr %s, [fp, #-%d]\n", regs[reg].name.c_str(), curFuncFrameSize - getOffset(src));
-                }
-                else {
-                    if (curFuncFrameSize - getOffset(src) > 255) {
-                        fprintf(fp, "\tmov32I r12, 0x%08x\n", getOffset(src) - curFuncFrameSize);
-                        fprintf(fp, "\tadd %s, fp, r12\n", regs[reg].name.c_str());
-                    }
-                    else
-                        fprintf(fp, "\tadd %s, fp, #-%d\n", regs[reg].name.c_str(), curFuncFrameSize - getOffset(src));
+            if (src->isArray && !src->isParam) {
+                if (!ctx->symbols[src->getName()]->staticLabel.empty()) {
+                    // 静态分配在.bss中的局部数组
+                    print("\tmov32I %s, %s\n", regs[reg].name.c_str(), ctx->symbols[src->getName()]->staticLabel.c_str());
                 }
+                else
+                    emitFrameAddress(reg, src);
             }
             else {
-                if (curFuncFrameSize - getOffset(src) > 4095) {
-                    fprintf(fp, "\tmov32I r12, 0x%08x\n", getOffset(src) - curFuncFrameSize);
-                    fprintf(fp, "\tldr %s, [fp, r12]\n", regs[reg].name.c_str());
-                }
-                else         
-                    fprintf(fp, "\tldr %s, [fp, #-%d]\n", regs[reg].name.c_str(), curFuncFrameSize - getOffset(src));       
+                std::string slot = frameSlot(src);
+                print("\tldr %s, %s\n", regs[reg].name.c_str(), slot.c_str());
             }
         else if (reg != preReg)
-            fprintf(fp, "\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
+            print("\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
     }
     if (src->type == VarType::ConstVar) {
         if (src->value > 65535 || src->value < 0)
-            fprintf(fp, "\tmov32I %s, %lld\n", regs[reg].name.c_str(), src->value);
+            print("\tmov32I %s, %lld\n", regs[reg].name.c_str(), src->value);
         else
-            fprintf(fp, "\tmov %s, #%lld\n", regs[reg].name.c_str(), src->value);
+            print("\tmov %s, #%lld\n", regs[reg].name.c_str(), src->value);
     }
     if (src->type == VarType::TempVar) {
         if (preReg == -1) {
-            for (int index = (int)stack.size() - 1; index >= 0; index--) {
-                if (varsAreSame(stack[index], src)) {
-                    if (index == (int)stack.size() - 1) {
-                        fprintf(fp, "\tpop {%s}\n", regs[reg].name.c_str());
-                        stack.pop_back();
-                    }
-                    else {
-                        fprintf(fp, "\tldr %s, [sp, #%u]\n", regs[reg].name.c_str(), (stack.size() - index - 1) * 4);
-                    }
-                    break;
-                }
-            } 
+            auto slot = spillSlots.find(src->getName());
+            if (slot != spillSlots.end()) {
+                std::string addr = spillSlot(slot->second);
+                print("\tldr %s, %s\n", regs[reg].name.c_str(), addr.c_str());
+            }
         }
         else if (reg != preReg)
-            fprintf(fp, "\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
+            print("\tmov %s, %s\n", regs[reg].name.c_str(), regs[preReg].name.c_str());
     }
 }
 
+std::string Arms::spillSlot(int slot) {
+    // 溢出槽紧贴在出参区之上（大栈帧）或局部变量区之上（小栈帧），都从sp访问
+    int off = outgoingSize + (useFrameBase ? 0 : curFuncFrameSize) + slot * 4;
+    if (off <= 4095)
+        return "[sp, #" + std::to_string(off) + "]";
+    print("\tmov32I r12, 0x%08x\n", off);
+    return "[sp, r12]";
+}
+
+void Arms::spillTemp(Register reg) {
+    Var * var = getRegContents(reg);
+    int slot;
+    auto it = spillSlots.find(var->getName());
+    if (it != spillSlots.end())
+        slot = it->second;
+    else if (!freeSpillSlots.empty()) {
+        slot = freeSpillSlots.back();
+        freeSpillSlots.pop_back();
+        spillSlots[var->getName()] = slot;
+    }
+    else {
+        slot = spillSlotCount++;
+        spillSlots[var->getName()] = slot;
+    }
+    std::string addr = spillSlot(slot);
+    print("\tstr %s, %s\t@ spill %s into frame slot\n", regs[reg].name.c_str(), addr.c_str(), var->getName().c_str());
+    regDescriptorRemove(var, reg);
+}
+
 void Arms::spillReg(Var * dst, Register reg) {
+    // 常驻寄存器的变量没有内存副本
+    if (homeRegFor(dst) != -1)
+        return;
     if (!(dst->isArray)) {
-        if (dst->type == VarType::GlobalVar) {
-            fprintf(fp, "\tmov32I %s, %s\n", regs[r12].name.c_str(), dst->getName().c_str());
-            fprintf(fp, "\tstr %s, [%s]\t@ spill %s into memory\n", regs[reg].name.c_str(), regs[r12].name.c_str(), dst->getName().c_str());
+        if (dst->type == VarType::GlobalVar && isMergedGlobal(dst))
+            print("\tstr %s, [%s, #%d]\t@ spill %s into memory\n", regs[reg].name.c_str(), regs[globalBase].name.c_str(), globalOffsets[dst->getName()], dst->getName().c_str());
+        else if (dst->type == VarType::GlobalVar) {
+            print("\tmov32I %s, %s\n", regs[r12].name.c_str(), dst->getName().c_str());
+            print("\tstr %s, [%s]\t@ spill %s into memory\n", regs[reg].name.c_str(), regs[r12].name.c_str(), dst->getName().c_str());
         }
         if (dst->type == VarType::LocalVar) {
-            if (curFuncFrameSize - getOffset(dst) > 4095) {
-                fprintf(fp, "\tmov32I r12, 0x%08x\n", getOffset(dst) - curFuncFrameSize);
-                fprintf(fp, "\tstr %s, [fp, r12]\t@ spill %s into memory\n", regs[reg].name.c_str(), dst->getName().c_str());
-                }
-            else       
-                fprintf(fp, "\tstr %s, [fp, #-%d]\t@ spill %s into memory\n", regs[reg].name.c_str(), curFuncFrameSize - getOffset(dst), dst->getName().c_str()); 
+            std::string slot = frameSlot(dst);
+            print("\tstr %s, %s\t@ spill %s into memory\n", regs[reg].name.c_str(), slot.c_str(), dst->getName().c_str());
         }
     }
     regDescriptorRemove(dst, reg);
@@ -274,6 +404,11 @@ Arms::Arms(const std::shared_ptr<Context> &context) {
     regs[pc] = (RegContents){NULL, (std::string)"pc", false, false, false};
 
     ctx = context;
+    allocLimit = r10;
+    lastAllocReg = r10;
+    useFrameBase = false;
+    freeVectorRegs = allocVectorRegs;
+    usesLaneIndex = false;
 
     opName[0] = "add";
     opName[1] = "sub";
@@ -286,14 +421,30 @@ Arms::Arms(const std::shared_ptr<Context> &context) {
     opName[8] = "no";
     opName[9] = "no";
     opName[10] = "no";
+    opName[11] = "and";
+    opName[12] = "asr";
 
     fp = fopen(context->target.c_str(), "w+");
 }
 
 void Arms::generateDiscardVar(Var * var) {
+    if (var->isVector) {
+        auto it = vectorRegs.find(var->getName());
+        if (it != vectorRegs.end()) {
+            freeVectorRegs |= 1u << it->second;
+            vectorRegs.erase(it);
+        }
+        return;
+    }
     int reg = findRegForVar(var);
     if (reg != -1)
         discardVarInReg(var, (Register)reg);
+    // 临时变量不再使用，它的溢出槽可以给别的临时变量
+    auto slot = spillSlots.find(var->getName());
+    if (slot != spillSlots.end()) {
+        freeSpillSlots.push_back(slot->second);
+        spillSlots.erase(slot);
+    }
 }
 
 void Arms::generateAssignConst(Var * dst, Var * src) {
@@ -302,10 +453,10 @@ void Arms::generateAssignConst(Var * dst, Var * src) {
     fillReg(dst, rd);
     regDescriptorInsert(dst, rd);
     if (src->value > 65535 || src->value < 0)
-        fprintf(fp, "\tmov32I %s, %lld\n", regs[rd].name.c_str(), src->value);
+        print("\tmov32I %s, %lld\n", regs[rd].name.c_str(), src->value);
     else
-        fprintf(fp, "\tmov %s, #%lld", regs[rd].name.c_str(), src->value);
-    fprintf(fp, "\t@ %s = %s\n", dst->getName().c_str(), src->getName().c_str());
+        print("\tmov %s, #%lld", regs[rd].name.c_str(), src->value);
+    print("\t@ %s = %s\n", dst->getName().c_str(), src->getName().c_str());
     regs[rd].mutexLock = false;
     if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
         spillReg(dst, rd);
@@ -326,10 +477,10 @@ void Arms::generateAssign(Var * dst, Var * src) {
     fillReg(dst, rd);
     regDescriptorInsert(dst, rd);
 
-    fprintf(fp, "\tmov %s, %s", regs[rd].name.c_str(), regs[rs].name.c_str());
+    print("\tmov %s, %s", regs[rd].name.c_str(), regs[rs].name.c_str());
     regs[rs].mutexLock = false;
     regs[rd].mutexLock = false;
-    fprintf(fp, "\t@ %s = %s\n", dst->getName().c_str(), src->getName().c_str());
+    print("\t@ %s = %s\n", dst->getName().c_str(), src->getName().c_str());
     if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
         spillReg(dst, rd);
 }
@@ -350,13 +501,13 @@ void Arms::generateLoad(Var * dst, Var * src, Var * offset) {
     fillReg(dst, rt);
     regDescriptorInsert(dst, rt);
 
-    fprintf(fp, "\tldr %s, [%s, %s, lsl #2]", regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
+    print("\tldr %s, [%s, %s, lsl #2]", regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
     regs[rs].mutexLock = false;
     regs[rd].mutexLock = false;
     regs[rt].mutexLock = false;
     if (offset->type == VarType::ConstVar)
         discardVarInReg(offset, rd);
-    fprintf(fp, "\t@ %s = %s[%s]\n", dst->getName().c_str(), src->getName().c_str(), offset->getName().c_str());
+    print("\t@ %s = %s[%s]\n", dst->getName().c_str(), src->getName().c_str(), offset->getName().c_str());
     if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
         spillReg(dst, rt);
 }
@@ -377,16 +528,38 @@ void Arms::generateStore(Var * dst, Var * offset, Var * src) {
     fillReg(dst, rt);
     regDescriptorInsert(dst, rt);
 
-    fprintf(fp, "\tstr %s, [%s, %s, lsl #2]", regs[rs].name.c_str(), regs[rt].name.c_str(), regs[rd].name.c_str());
+    print("\tstr %s, [%s, %s, lsl #2]", regs[rs].name.c_str(), regs[rt].name.c_str(), regs[rd].name.c_str());
     regs[rs].mutexLock = false;
     regs[rd].mutexLock = false;
     regs[rt].mutexLock = false;
     if (offset->type == VarType::ConstVar)
         discardVarInReg(offset, rd);
-    fprintf(fp, "\t@ %s[%s] = %s\n", dst->getName().c_str(), offset->getName().c_str(), src->getName().c_str());
+    print("\t@ %s[%s] = %s\n", dst->getName().c_str(), offset->getName().c_str(), src->getName().c_str());
 }
 
 void Arms::generateBinaryOP(Binary_op::OpCode op, Var * dst, Var * src_1, Var * src_2) {
+    // 按位与和右移的常量操作数能编码成立即数时不占寄存器
+    if ((op == Binary_op::And || op == Binary_op::Shr) && src_2->type == VarType::ConstVar && src_2->value >= 0 &&
+        src_2->value <= 255) {
+        rs = (Register)pickRegForVar(src_1);
+        regs[rs].mutexLock = true;
+        fillReg(src_1, rs);
+        regDescriptorInsert(src_1, rs);
+
+        rt = (Register)pickRegForVar(dst);
+        regs[rt].mutexLock = true;
+        fillReg(dst, rt);
+        regDescriptorInsert(dst, rt);
+        print("\t%s %s, %s, #%lld", opName[op].c_str(), regs[rt].name.c_str(), regs[rs].name.c_str(), (long long)src_2->value);
+        regs[rs].mutexLock = false;
+        regs[rt].mutexLock = false;
+        if (src_1->type == VarType::ConstVar)
+            discardVarInReg(src_1, rs);
+        print("\t@ %s = %s %s %s\n", dst->getName().c_str(), src_1->getName().c_str(), opName[op].c_str(), src_2->getName().c_str());
+        if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
+            spillReg(dst, rt);
+        return;
+    }
     rs = (Register)pickRegForVar(src_1);
     regs[rs].mutexLock = true;
     fillReg(src_1, rs);
@@ -402,9 +575,9 @@ void Arms::generateBinaryOP(Binary_op::OpCode op, Var * dst, Var * src_1, Var *
     fillReg(dst, rt);
     regDescriptorInsert(dst, rt);
     if (src_1->isArray)
-        fprintf(fp, "\t%s %s, %s, %s, lsl #2", opName[op].c_str(), regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
+        print("\t%s %s, %s, %s, lsl #2", opName[op].c_str(), regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
     else
-        fprintf(fp, "\t%s %s, %s, %s", opName[op].c_str(), regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
+        print("\t%s %s, %s, %s", opName[op].c_str(), regs[rt].name.c_str(), regs[rs].name.c_str(), regs[rd].name.c_str());
     regs[rs].mutexLock = false;
     regs[rt].mutexLock = false;
     regs[rd].mutexLock = false; 
@@ -412,29 +585,28 @@ void Arms::generateBinaryOP(Binary_op::OpCode op, Var * dst, Var * src_1, Var *
         discardVarInReg(src_1, rs);
     if (src_2->type == VarType::ConstVar)
         discardVarInReg(src_2, rd);
-    fprintf(fp, "\t@ %s = %s %s %s\n", dst->getName().c_str(), src_1->getName().c_str(), opName[op].c_str(), src_2->getName().c_str());
+    print("\t@ %s = %s %s %s\n", dst->getName().c_str(), src_1->getName().c_str(), opName[op].c_str(), src_2->getName().c_str());
     if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
         spillReg(dst, rt);
 }
 
 void Arms::generateLabel(std::string label) {
     if (label[0] != '.') {
-        fprintf(fp, "\t.text\n");
-        fprintf(fp, "\t.align 1\n");
-        fprintf(fp, "\t.global %s\n", label.c_str());
-        fprintf(fp, "\t.syntax unified\n");
-        fprintf(fp, "\t.type %s, %%function\n", label.c_str());
+        print("\t.text\n");
+        print("\t.align 1\n");
+        print("\t.global %s\n", label.c_str());
+        print("\t.syntax unified\n");
+        print("\t.type %s, %%function\n", label.c_str());
         curFuncFrameSize = ctx->functions[curFuncLabel]->stackSize;
     }
     else
         cleanRegForBranch();
-    fprintf(fp, "%s:\n", label.c_str());
-    stack.clear();
+    print("%s:\n", label.c_str());
 }
 
 void Arms::generateGOTO(std::string label) {
     cleanRegForBranch();
-    fprintf(fp, "\tb %s\n", label.c_str());
+    print("\tb %s\n", label.c_str());
 }
 
 void Arms::generateIfZ(Var * test, std::string label) {
@@ -444,9 +616,9 @@ void Arms::generateIfZ(Var * test, std::string label) {
     fillReg(test, rs);
     regDescriptorInsert(test, rs);
 
-    fprintf(fp, "\tcmp %s, #0\n", regs[rs].name.c_str());
-    fprintf(fp, "\tbeq %s", label.c_str());
-    fprintf(fp, "\t@ beq %s, %s\n", test->getName().c_str(), label.c_str());
+    print("\tcmp %s, #0\n", regs[rs].name.c_str());
+    print("\tbeq %s", label.c_str());
+    print("\t@ beq %s, %s\n", test->getName().c_str(), label.c_str());
     regs[rs].mutexLock = false;
     if (test->type == VarType::ConstVar)
         discardVarInReg(test, rs);
@@ -464,30 +636,30 @@ void Arms::generateCMP(TokenType opType, Var * src_1, Var * src_2, std::string l
     fillReg(src_2, rd);
     regDescriptorInsert(src_2, rd);
 
-    fprintf(fp, "\tcmp %s, %s\n", regs[rs].name.c_str(), regs[rd].name.c_str());
+    print("\tcmp %s, %s\n", regs[rs].name.c_str(), regs[rd].name.c_str());
     if (opType == TokenType::op_equaleq) {
-        fprintf(fp, "\tbeq %s", label.c_str());
-        fprintf(fp, "\t@ %s == %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tbeq %s", label.c_str());
+        print("\t@ %s == %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     if (opType == TokenType::op_exclaimeq) {
-        fprintf(fp, "\tbne %s", label.c_str());
-        fprintf(fp, "\t@ %s != %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tbne %s", label.c_str());
+        print("\t@ %s != %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     if (opType == TokenType::op_greater) {
-        fprintf(fp, "\tbgt %s", label.c_str());
-        fprintf(fp, "\t@ %s > %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tbgt %s", label.c_str());
+        print("\t@ %s > %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     if (opType == TokenType::op_less) {
-        fprintf(fp, "\tblt %s", label.c_str());
-        fprintf(fp, "\t@ %s < %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tblt %s", label.c_str());
+        print("\t@ %s < %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     if (opType == TokenType::op_greatereq) {
-        fprintf(fp, "\tbge %s", label.c_str());
-        fprintf(fp, "\t@ %s >= %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tbge %s", label.c_str());
+        print("\t@ %s >= %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     if (opType == TokenType::op_lesseq) {
-        fprintf(fp, "\tble %s", label.c_str());
-        fprintf(fp, "\t@ %s <= %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
+        print("\tble %s", label.c_str());
+        print("\t@ %s <= %s, goto %s\n", src_1->getName().c_str(), src_2->getName().c_str(), label.c_str());
     }
     regs[rs].mutexLock = false;
     regs[rd].mutexLock = false;
@@ -497,41 +669,158 @@ void Arms::generateCMP(TokenType opType, Var * src_1, Var * src_2, std::string l
         discardVarInReg(src_2, rd);
 }
 
-void Arms::generateBeginFunc(std::string curFunc, int frameSize) {
-    fprintf(fp, "\tpush {fp, lr}\n");
-    fprintf(fp, "\tadd fp, sp, #0\n");
-    if (frameSize > 255) {
-        fprintf(fp, "\tmov32I r12, 0x%08x\n", frameSize);
-        fprintf(fp, "\tsub sp, sp, r12\n");
+int Arms::homeRegFor(Var * var) {
+    if (var == nullptr || var->type != VarType::LocalVar || homeRegs.empty())
+        return -1;
+    auto it = homeRegs.find(var->getName());
+    return it == homeRegs.end() ? -1 : it->second;
+}
+
+void Arms::assignHomeRegs(std::string curFunc) {
+    // 引用最频繁的标量局部变量和参数常驻在编号最大的可分配寄存器中，
+    // 它们都是被调用者保存的寄存器，跨越调用也不必写回内存
+    homeRegs.clear();
+    auto &func = ctx->functions[curFunc];
+    std::vector<std::shared_ptr<syntax::VarDefinition>> candidates;
+    for (auto &def : func->params)
+        candidates.push_back(def);
+    for (auto &def : func->locals)
+        if (def->dimensionDef.empty())
+            candidates.push_back(def);
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+        return a->accessWeight > b->accessWeight;
+    });
+    for (auto &def : candidates) {
+        if (lastAllocReg - r0 + 1 <= minScratchRegs || def->accessWeight < homeMinWeight)
+            break;
+        homeRegs[def->varName->mangledId] = (Register)lastAllocReg;
+        usedRegs |= 1u << lastAllocReg;
+        lastAllocReg--;
     }
-    else
-        fprintf(fp, "\tsub sp, sp, #%d\n", frameSize);
-    int parNum = ctx->functions[curFunc]->params.size();
-    if (parNum > 4)
-        parNum = 4;
-    for (int i = 0; i < parNum; i++) {
-        if (frameSize - i * 4 > 4095) {
-            fprintf(fp, "\tmov32I r12, 0x%08x\n", i * 4 - frameSize);
-            fprintf(fp, "\tstr r%d, [fp, r12]\n", i);
+}
+
+void Arms::generateBeginFunc(std::string curFunc, int frameSize, bool loadGlobalBase) {
+    // 函数体中sp保持不变，小栈帧的所有槽都从sp访问，省去帧指针；
+    // 帧的低端超出了fp的寻址范围时才保留fp，并用局部变量区的底部作为第二个基址
+    useFrameBase = frameSize > 4095;
+    lastAllocReg = useFrameBase ? frameBase - 1 : allocLimit;
+    curFuncLoadGlobalBase = loadGlobalBase;
+    usedRegs = 0;
+    if (useFrameBase)
+        usedRegs |= 1u << frameBase;
+    if (loadGlobalBase)
+        usedRegs |= 1u << globalBase;
+    assignHomeRegs(curFunc);
+    spillSlots.clear();
+    freeSpillSlots.clear();
+    spillSlotCount = 0;
+    hasCall = false;
+    // 第5个起的实参由调用者存放在自己栈帧最底部的出参区
+    outgoingSize = 0;
+    for (auto &callee : ctx->functions[curFunc]->callees) {
+        auto it = ctx->functions.find(callee);
+        if (it != ctx->functions.end())
+            outgoingSize = std::max(outgoingSize, ((int)it->second->params.size() - 4) * 4);
+    }
+    // 溢出槽的数量、用到的寄存器要到函数体生成完才知道，函数体先写入缓冲区，结束时再补上序言
+    buffering = true;
+    body.clear();
+}
+
+std::string Arms::savedRegList(const char * link) {
+    // 函数中实际用到的被调用者保存寄存器，保留帧指针时还有fp，非叶函数还要保存返回地址
+    std::string list;
+    for (int i = r4; i <= r10; i++)
+        if (usedRegs & (1u << i))
+            list += (list.empty() ? "" : ", ") + regs[i].name;
+    if (useFrameBase)
+        list += (list.empty() ? "" : ", ") + regs[Fp].name;
+    if (hasCall)
+        list += (list.empty() ? "" : ", ") + std::string(link);
+    return list;
+}
+
+int Arms::savedRegSize() {
+    return ((int)std::bitset<32>(usedRegs & 0x7f0).count() + useFrameBase + hasCall) * 4;
+}
+
+void Arms::generatePrologue(std::string curFunc, int frameSize) {
+    // 自下而上依次是出参区、溢出槽和局部变量区（小栈帧时局部变量区在溢出槽之下），
+    // 之上是用一条push保存的寄存器；有调用时sp要保持8字节对齐，叶函数不需要
+    std::string saved = savedRegList("lr");
+    int pushSize = savedRegSize();
+    frameTotal = outgoingSize + frameSize + spillSlotCount * 4;
+    if (hasCall)
+        frameTotal = ((frameTotal + pushSize + 7) & ~7) - pushSize;
+    if (!saved.empty())
+        print("\tpush {%s}\n", saved.c_str());
+    if (useFrameBase)
+        print("\tmov fp, sp\n");
+    if (frameTotal != 0)
+        emitAddImm("sp", "sp", -frameTotal);
+    if (curFuncLoadGlobalBase)
+        print("\tmov32I %s, %s\n", regs[globalBase].name.c_str(), globalBlockLabel);
+    if (useFrameBase)
+        emitAddImm(regs[frameBase].name.c_str(), "fp", -frameSize);
+    // 参数槽位于局部变量区的底部；常驻寄存器的参数直接移入寄存器，
+    // 栈上传入的参数位于保存的寄存器之上，也搬到参数槽或常驻寄存器中
+    auto slotAt = [this](const char * base, int off) {
+        if (off <= 4095)
+            return "[" + std::string(base) + ", #" + std::to_string(off) + "]";
+        print("\tmov32I r12, 0x%08x\n", off);
+        return "[" + std::string(base) + ", r12]";
+    };
+    auto &params = ctx->functions[curFunc]->params;
+    for (int i = 0; i < (int)params.size(); i++) {
+        auto it = homeRegs.find(params[i]->varName->mangledId);
+        int home = it == homeRegs.end() ? -1 : it->second;
+        if (i < 4 && home != -1) {
+            print("\tmov %s, r%d\n", regs[home].name.c_str(), i);
+            continue;
         }
-        else
-            fprintf(fp, "\tstr r%d, [fp, #-%d]\n", i, frameSize - i * 4);
+        std::string reg = i < 4 ? "r" + std::to_string(i) : home != -1 ? regs[home].name : "r12";
+        if (i >= 4) {
+            std::string incoming = useFrameBase ? slotAt("fp", pushSize + (i - 4) * 4)
+                                                : slotAt("sp", frameTotal + pushSize + (i - 4) * 4);
+            print("\tldr %s, %s\n", reg.c_str(), incoming.c_str());
+            if (home != -1)
+                continue;
+        }
+        std::string slot = useFrameBase ? "[" + regs[frameBase].name + ", #" + std::to_string(i * 4) + "]"
+                                        : slotAt("sp", outgoingSize + i * 4);
+        print("\tstr %s, %s\n", reg.c_str(), slot.c_str());
     }
+}
 
+bool Arms::usesMergedGlobal(Instruction * tac) {
+    Var * vars[3] = {tac->src_1, tac->src_2, tac->dst};
+    for (int i = 0; i < tac->numVars && i < 3; i++)
+        if (vars[i] != nullptr && isMergedGlobal(vars[i]))
+            return true;
+    return false;
 }
 
 void Arms::generateEndFunc(std::string curFunc, int frameSize) {
-    fprintf(fp, "\tadd sp, fp, #0\n");
-    if (curFunc == "main")
-        fprintf(fp, "\tpop {fp, pc}\n");
-    else
-        fprintf(fp, "\tpop {fp, lr}\n");
-    fprintf(fp, "\tbx lr\n");
-    fprintf(fp, "\t.size %s, .-%s\n", curFunc.c_str(), curFunc.c_str());
+    buffering = false;
+    generatePrologue(curFunc, frameSize);
+    fwrite(body.data(), 1, body.size(), fp);
+    body.clear();
+    if (useFrameBase)
+        print("\tmov sp, fp\n");
+    else if (frameTotal != 0)
+        emitAddImm("sp", "sp", frameTotal);
+    // 返回地址直接弹入pc；叶函数没有保存lr，用bx返回
+    std::string saved = savedRegList("pc");
+    if (!saved.empty())
+        print("\tpop {%s}\n", saved.c_str());
+    if (!hasCall)
+        print("\tbx lr\n");
+    print("\t.size %s, .-%s\n", curFunc.c_str(), curFunc.c_str());
     regDescriptor.clear();
-    stack.clear();
     for (int i = r0; i <= r10; i++)
         regs[i].isDirty = false;
+    vectorRegs.clear();
+    freeVectorRegs = allocVectorRegs;
 }
 
 void Arms::generateReturn(Var * result) {
@@ -540,112 +829,336 @@ void Arms::generateReturn(Var * result) {
         rs = (Register)pickRegForVar(result);
         regs[rs].mutexLock = true;
         fillReg(result, rs);
-        fprintf(fp, "\tmov r0, %s\n", regs[rs].name.c_str());
-        fprintf(fp, "\t@ return %s\n", result->getName().c_str());
+        print("\tmov r0, %s\n", regs[rs].name.c_str());
+        print("\t@ return %s\n", result->getName().c_str());
         regs[rs].mutexLock = false;
     }
     return;
 }
 
-void Arms::generateParam(Var * arg, int num, int frame) {
-    if (num == 1)
-        cleanRegForCall();
-    if (num <= 4) {
-        if (arg->type == VarType::ConstVar || arg->type == VarType::GlobalVar || arg->type == VarType::LocalVar || arg->type == VarType::StringVar)
-            fillReg(arg, (Register)(num - 1));
-        else {
-            int index = 0;
-            for (index = 0; index < (int)stack.size(); index++)
-                if (varsAreSame(arg, stack[index]))
-                    break;
-            if ((stack.size() - index - 1) * 4 == 0) {
-                fprintf(fp, "\tpop {r%d}\n", num - 1);
-                stack.pop_back();
-            }
-            else
-                fprintf(fp, "\tldr r%d, [sp, #%u]\n", num - 1, (stack.size() - index - 1) * 4);
+void Arms::generateParam(Var * arg, int num, bool lastUse) {
+    // 实参先记录下来，到call时统一生成
+    pendingArgs.push_back(PendingArg{arg, num, lastUse});
+}
+
+bool Arms::isDyingArg(Var * var) {
+    for (auto &arg : pendingArgs)
+        if (arg.lastUse && varsAreSame(arg.var, var))
+            return true;
+    return false;
+}
+
+void Arms::emitParallelMoves(std::vector<std::pair<Register, Register>> moves) {
+    // moves中的(dst, src)同时生效：每次先做目的寄存器不再被读的move，
+    // 只剩环时把一个源寄存器暂存到r12打破环
+    while (!moves.empty()) {
+        bool progress = false;
+        for (size_t i = 0; i < moves.size(); i++) {
+            bool blocked = false;
+            for (size_t j = 0; j < moves.size(); j++)
+                if (j != i && moves[j].second == moves[i].first)
+                    blocked = true;
+            if (blocked)
+                continue;
+            print("\tmov %s, %s\n", regs[moves[i].first].name.c_str(), regs[moves[i].second].name.c_str());
+            moves.erase(moves.begin() + i);
+            progress = true;
+            break;
         }
-        fprintf(fp, "\t@ param %s\n", arg->getName().c_str());
-    } else {
-        if (arg->type == VarType::ConstVar || arg->type == VarType::GlobalVar || arg->type == VarType::LocalVar || arg->type == VarType::StringVar) {
-            fillReg(arg, r4);   
-            fprintf(fp, "\tstr r4, [sp, #-%d]\n", 8 + frame - (num - 1) * 4);
+        if (!progress) {
+            Register src = moves.front().second;
+            print("\tmov r12, %s\n", regs[src].name.c_str());
+            for (auto &move : moves)
+                if (move.second == src)
+                    move.second = r12;
         }
-        else {
-            int index = 0;
-            for (index = 0; index < (int)stack.size(); index++)
-                if (varsAreSame(arg, stack[index]))
-                    break;
-            fprintf(fp, "\tldr r4, [sp, #%u]\n", (stack.size() - index - 1) * 4);
-            fprintf(fp, "\tstr r4, [sp, #-%d]\n", 8 + frame - (num - 1) * 4);
+    }
+}
+
+void Arms::lowerCallArgs() {
+    cleanRegForCall();
+    std::vector<std::pair<Register, Register>> moves;
+    std::vector<PendingArg> loads;
+    for (auto &arg : pendingArgs) {
+        int src = findRegForVar(arg.var);
+        if (arg.num > 4) {
+            // 栈上传递的参数存到出参区
+            if (src == -1) {
+                fillReg(arg.var, r12);
+                src = r12;
+            }
+            print("\tstr %s, [sp, #%d]\t@ param %s\n", regs[src].name.c_str(), (arg.num - 5) * 4, arg.var->getName().c_str());
         }
-        fprintf(fp, "\t@ param %s\n", arg->getName().c_str());
+        else if (src == -1)
+            loads.push_back(arg);
+        else if (src != arg.num - 1)
+            moves.emplace_back((Register)(arg.num - 1), (Register)src);
+    }
+    emitParallelMoves(moves);
+    for (auto &arg : loads)
+        fillReg(arg.var, (Register)(arg.num - 1));
+    pendingArgs.clear();
+    // r0-r3在调用后被破坏
+    for (int i = r0; i <= r3; i++) {
+        Var * var = getRegContents((Register)i);
+        if (var != NULL)
+            regDescriptorRemove(var, (Register)i);
     }
 }
 
 void Arms::generateCall(int numVars, std::string label, Var * result, int paramNum) {
-    if (paramNum == 0)
-        cleanRegForCall();
-    fprintf(fp, "\tbl %s\n", label.c_str());
+    lowerCallArgs();
+    print("\tbl %s\n", label.c_str());
+    hasCall = true;
     if (numVars == 1) {
+        // 返回值整个覆盖result，不必先读入旧值；读入会冲掉已经选中的r0/r1中的返回值
         rd = (Register)pickRegForVar(result);
         regs[rd].mutexLock = true;
-        fillReg(result, rd);
         regDescriptorInsert(result, rd);
         if (label == "__aeabi_idivmod")
-            fprintf(fp, "\tmov %s, r1", regs[rd].name.c_str());
+            print("\tmov %s, r1", regs[rd].name.c_str());
         else
-            fprintf(fp, "\tmov %s, r0", regs[rd].name.c_str());
-        fprintf(fp, "\t@ %s = %s\n", result->getName().c_str(), label.c_str());
+            print("\tmov %s, r0", regs[rd].name.c_str());
+        print("\t@ %s = %s\n", result->getName().c_str(), label.c_str());
         regs[rd].mutexLock = false;
+        if (result->type == VarType::LocalVar || result->type == VarType::GlobalVar)
+            spillReg(result, rd);
     }
 }
 
+int Arms::vectorRegFor(Var * var) {
+    auto it = vectorRegs.find(var->getName());
+    if (it != vectorRegs.end())
+        return it->second;
+    // 向量化时已经限制了同时活跃的向量个数，不会出现寄存器不够的情况
+    int q = trailingZeros(freeVectorRegs);
+    freeVectorRegs &= ~(1u << q);
+    vectorRegs[var->getName()] = q;
+    return q;
+}
+
+std::string Arms::vectorRegList(int q) {
+    return "{d" + std::to_string(2 * q) + "-d" + std::to_string(2 * q + 1) + "}";
+}
+
+void Arms::generateVectorLoad(Var * dst, Var * src, Var * offset) {
+    rs = (Register)pickRegForVar(src);
+    regs[rs].mutexLock = true;
+    fillReg(src, rs);
+    regDescriptorInsert(src, rs);
+
+    rd = (Register)pickRegForVar(offset);
+    regs[rd].mutexLock = true;
+    fillReg(offset, rd);
+    regDescriptorInsert(offset, rd);
+
+    // vld1没有寄存器偏移的寻址方式，地址先算到r12
+    int q = vectorRegFor(dst);
+    print("\tadd r12, %s, %s, lsl #2\n", regs[rs].name.c_str(), regs[rd].name.c_str());
+    print("\tvld1.32 %s, [r12]", vectorRegList(q).c_str());
+    regs[rs].mutexLock = false;
+    regs[rd].mutexLock = false;
+    if (offset->type == VarType::ConstVar)
+        discardVarInReg(offset, rd);
+    print("\t@ %s = %s[%s:4]\n", dst->getName().c_str(), src->getName().c_str(), offset->getName().c_str());
+}
+
+void Arms::generateVectorStore(Var * dst, Var * offset, Var * src) {
+    rd = (Register)pickRegForVar(offset);
+    regs[rd].mutexLock = true;
+    fillReg(offset, rd);
+    regDescriptorInsert(offset, rd);
+
+    rt = (Register)pickRegForVar(dst);
+    regs[rt].mutexLock = true;
+    fillReg(dst, rt);
+    regDescriptorInsert(dst, rt);
+
+    int q = vectorRegFor(src);
+    print("\tadd r12, %s, %s, lsl #2\n", regs[rt].name.c_str(), regs[rd].name.c_str());
+    print("\tvst1.32 %s, [r12]", vectorRegList(q).c_str());
+    regs[rd].mutexLock = false;
+    regs[rt].mutexLock = false;
+    if (offset->type == VarType::ConstVar)
+        discardVarInReg(offset, rd);
+    print("\t@ %s[%s:4] = %s\n", dst->getName().c_str(), offset->getName().c_str(), src->getName().c_str());
+}
+
+void Arms::generateVectorOP(VectorOp::OpCode op, Var * dst, Var * src_1, Var * src_2) {
+    const char * name = op == VectorOp::Add ? "vadd" : op == VectorOp::Sub ? "vsub" : "vmul";
+    int qn = vectorRegFor(src_1);
+    int qm = vectorRegFor(src_2);
+    int qd = vectorRegFor(dst);
+    print("\t%s.i32 q%d, q%d, q%d", name, qd, qn, qm);
+    print("\t@ %s = %s %s %s\n", dst->getName().c_str(), src_1->getName().c_str(), VectorOp::opName[op].c_str(), src_2->getName().c_str());
+}
+
+void Arms::generateVectorDup(Var * dst, Var * src) {
+    rs = (Register)pickRegForVar(src);
+    regs[rs].mutexLock = true;
+    fillReg(src, rs);
+    regDescriptorInsert(src, rs);
+
+    int q = vectorRegFor(dst);
+    print("\tvdup.32 q%d, %s", q, regs[rs].name.c_str());
+    regs[rs].mutexLock = false;
+    if (src->type == VarType::ConstVar)
+        discardVarInReg(src, rs);
+    print("\t@ %s = vdup %s\n", dst->getName().c_str(), src->getName().c_str());
+}
+
+void Arms::generateVectorIndex(Var * dst, Var * src) {
+    // {x, x, x, x} + {0, 1, 2, 3}
+    rs = (Register)pickRegForVar(src);
+    regs[rs].mutexLock = true;
+    fillReg(src, rs);
+    regDescriptorInsert(src, rs);
+
+    int q = vectorRegFor(dst);
+    print("\tvdup.32 q%d, %s\n", q, regs[rs].name.c_str());
+    print("\tmov32I r12, %s\n", laneIndexLabel);
+    print("\tvld1.32 %s, [r12]\n", vectorRegList(vectorScratch).c_str());
+    print("\tvadd.i32 q%d, q%d, q%d", q, q, vectorScratch);
+    regs[rs].mutexLock = false;
+    if (src->type == VarType::ConstVar)
+        discardVarInReg(src, rs);
+    print("\t@ %s = vindex %s\n", dst->getName().c_str(), src->getName().c_str());
+    usesLaneIndex = true;
+}
+
+void Arms::generateVectorSum(Var * dst, Var * src) {
+    // 高低两半相加后再两两相加，4个lane的和在d的第0个lane
+    int q = vectorRegFor(src);
+    int d = 2 * vectorScratch;
+    rt = (Register)pickRegForVar(dst);
+    regs[rt].mutexLock = true;
+    fillReg(dst, rt);
+    regDescriptorInsert(dst, rt);
+
+    print("\tvadd.i32 d%d, d%d, d%d\n", d, 2 * q, 2 * q + 1);
+    print("\tvpadd.i32 d%d, d%d, d%d\n", d, d, d);
+    print("\tvmov.32 %s, d%d[0]", regs[rt].name.c_str(), d);
+    regs[rt].mutexLock = false;
+    print("\t@ %s = vsum %s\n", dst->getName().c_str(), src->getName().c_str());
+    if (dst->type == VarType::LocalVar || dst->type == VarType::GlobalVar)
+        spillReg(dst, rt);
+}
+
 void Arms::generateHeaders() {
-    fprintf(fp, "\t.arch armv8-a\n");
-    fprintf(fp, "\t.arch armv7ve\n");
-    fprintf(fp, "\t.fpu vfp\n");
-    fprintf(fp, "\t.macro mov32I, reg, val\n");
-    fprintf(fp, "\t\tmovw \\reg, #:lower16:\\val\n");
-    fprintf(fp, "\t\tmovt \\reg, #:upper16:\\val\n");
-    fprintf(fp, "\t.endm\n");
+    print("\t.arch armv8-a\n");
+    print("\t.arch armv7ve\n");
+    print(ctx->neon ? "\t.fpu neon\n" : "\t.fpu vfp\n");
+    print("\t.macro mov32I, reg, val\n");
+    print("\t\tmovw \\reg, #:lower16:\\val\n");
+    print("\t\tmovt \\reg, #:upper16:\\val\n");
+    print("\t.endm\n");
 }
 
-void Arms::generateGlobal() {
-    for (size_t i = 0; i < ctx->globals.size(); i++) {
-        fprintf(fp, "\t.global %s\n", ctx->globals[i]->varName->toString().c_str());
-        fprintf(fp, "\t.data\n");
-        fprintf(fp, "\t.align 2\n");
-        fprintf(fp, "\t.type %s, %%object\n", ctx->globals[i]->varName->toString().c_str());
-        fprintf(fp, "\t.size %s, %u\n", ctx->globals[i]->varName->toString().c_str(), ctx->globals[i]->accumulation.front() * 4);
-        fprintf(fp, "%s:\n", ctx->globals[i]->varName->toString().c_str());
-        if (ctx->globals[i]->initialValue != nullptr) {
-            int space = 0;
-            for (size_t j = 0; j < ctx->globals[i]->values.size(); j++) {
-                while ((ctx->globals[i]->values[j] == 0) && (j < ctx->globals[i]->values.size())) {
-                    space = space + 4;
-                    j++;
-                }
-                if (space != 0)
-                    fprintf(fp, "\t.space %d\n", space);
-                if ((ctx->globals[i]->values[j] != 0) && (j < ctx->globals[i]->values.size()))
-                    fprintf(fp, "\t.word %d\n", ctx->globals[i]->values[j]);
-                space = 0;
+void Arms::generateGlobalData(const std::shared_ptr<syntax::VarDefinition> &def) {
+    std::string name = def->varName->toString();
+    print("\t.global %s\n", name.c_str());
+    print("\t.type %s, %%object\n", name.c_str());
+    print("\t.size %s, %u\n", name.c_str(), def->accumulation.front() * 4);
+    print("%s:\n", name.c_str());
+    generateValues(def->values, def->accumulation.front());
+}
+
+void Arms::generateValues(const std::vector<syntax::ValueRun> &values, std::size_t total) {
+    // 段之间的零用.zero补齐，连续重复的值用.fill
+    std::size_t pos = 0;
+    for (auto &run : values) {
+        if (run.index > pos)
+            print("\t.zero %zu\n", (run.index - pos) * 4);
+        for (std::size_t j = 0; j < run.values.size();) {
+            std::size_t k = j + 1;
+            while (k < run.values.size() && run.values[k] == run.values[j])
+                k++;
+            if (k - j >= fillMinRepeat) {
+                print("\t.fill %zu, 4, %d\n", k - j, run.values[j]);
+            } else {
+                for (std::size_t i = j; i < k; i++)
+                    print("\t.word %d\n", run.values[i]);
             }
+            j = k;
         }
-        else
-            fprintf(fp, "\t.space %d\n", ctx->globals[i]->accumulation.front() * 4);
+        pos = run.index + run.values.size();
     }
+    if (total > pos)
+        print("\t.zero %zu\n", (total - pos) * 4);
+}
+
+const char * Arms::globalSection(const std::shared_ptr<syntax::VarDefinition> &def) {
+    // const数组只读；全零的变量放进.bss，不占目标文件空间
+    if (def->isConst && !def->dimensionDef.empty())
+        return "\t.section .rodata\n";
+    if (def->values.empty())
+        return "\t.bss\n";
+    return "\t.data\n";
+}
+
+void Arms::generateGlobal() {
+    // 标量优先、其次是小数组，依次排进同一个连续的块，函数中只需载入一次块基址
+    // const数组要放进.rodata，不参与合并
+    std::vector<std::shared_ptr<syntax::VarDefinition>> merged;
+    int blockSize = 0;
+    bool blockIsZero = true;
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto &def : ctx->globals) {
+            int size = def->accumulation.front() * 4;
+            if (def->dimensionDef.empty() != (pass == 0) || size > mergeArrayLimit)
+                continue;
+            if (pass == 1 && def->isConst)
+                continue;
+            if (blockSize + size > mergeBlockLimit)
+                continue;
+            globalOffsets[def->varName->toString()] = blockSize;
+            merged.push_back(def);
+            blockSize += size;
+            blockIsZero = blockIsZero && def->values.empty();
+        }
+    }
+    if (!merged.empty()) {
+        allocLimit = globalBase - 1;
+        print(blockIsZero ? "\t.bss\n" : "\t.data\n");
+        print("\t.align 2\n");
+        print("%s:\n", globalBlockLabel);
+        for (auto &def : merged)
+            generateGlobalData(def);
+    }
+    for (auto &def : ctx->globals) {
+        if (globalOffsets.count(def->varName->toString()) != 0)
+            continue;
+        print("%s", globalSection(def));
+        print("\t.align 2\n");
+        generateGlobalData(def);
+    }
+    // 不可重入函数中静态分配的局部数组
+    for (auto &def : ctx->staticLocals)
+        print("\t.lcomm %s, %d, 4\n", def->staticLabel.c_str(), def->accumulation.front() * 4);
+    // 局部数组常量初始化的模板
+    for (auto &def : ctx->initTemplates) {
+        print("\t.section .rodata\n");
+        print("\t.align 2\n");
+        print("%s:\n", def->initLabel.c_str());
+        generateValues(def->values, def->accumulation.front());
+    }
+    // 相同的字符串在Sema中已经共用一个标号，可合并的段让链接器再跨文件去重
+    if (!ctx->strings.empty())
+        print("\t.section .rodata.str1.1,\"aMS\",%%progbits,1\n");
     for(auto &s : ctx->strings) {
-        fprintf(fp, "\t.rodata\n");
-        fprintf(fp, "\t.align 2\n");
-        fprintf(fp, "%s:\n", s.second.c_str());
-        fprintf(fp, "\t.ascii \"%s\\000\"\n", s.first.c_str());
+        print("%s:\n", s.second.c_str());
+        print("\t.ascii \"%s\\000\"\n", s.first.c_str());
     }
-    fprintf(fp, "\t.text\n");
-    fprintf(fp, "\t.global __aeabi_idivmod\n");
+    print("\t.text\n");
+    print("\t.global __aeabi_idivmod\n");
 }
 
 void Arms::generateEnders() {
-    fprintf(fp, "\t.section .note.GNU-stack,\"\",%%progbits\n");
+    if (usesLaneIndex) {
+        print("\t.section .rodata\n");
+        print("\t.align 3\n");
+        print("%s:\n", laneIndexLabel);
+        print("\t.word 0, 1, 2, 3\n");
+    }
+    print("\t.section .note.GNU-stack,\"\",%%progbits\n");
 }
\ No newline at end of file
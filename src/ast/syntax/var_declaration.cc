@@ -1,5 +1,6 @@
 #include <rang/rang.h>
 #include <sstream>
+#include <algorithm>
 #include <ast/syntax/var_declaration.h>
 
 namespace kisyshot::ast::syntax {
@@ -153,12 +154,7 @@ namespace kisyshot::ast::syntax {
             if(initialValue->getType() ==SyntaxType::ArrayInitializeExpression) {
                 //数组初始化,先设置数组属性
                 //initialValue->genCode(gen,src_1);
-                for (size_t i = 0; i < srcArray.size(); i++) {
-                    //temp[i] = t;
-                    Var *t = srcArray[i]->getVar(gen);
-                    Var *offset = gen.getConstVar(i);
-                    gen.genStore(t, src_1, offset);
-                }
+                genArrayInit(gen, src_1);
             }else{
                 //initialValue有可能是一个数字
                 Var * src_2 = initialValue->getVar(gen);
@@ -166,4 +162,60 @@ namespace kisyshot::ast::syntax {
             }
         }
     }
-}
\ No newline at end of file
+
+    void VarDefinition::addValue(std::size_t index, int value) {
+        if (value == 0)
+            return;
+        if (values.empty() || values.back().index + values.back().values.size() != index)
+            values.push_back(ValueRun{index, {}});
+        values.back().values.push_back(value);
+    }
+
+    void VarDefinition::genArrayInit(compiler::CodeGenerator &gen, ast::Var *array) {
+        std::size_t total = accumulation.front();
+        Var *bytes = gen.getConstVar(total * 4);
+        if (!initLabel.empty()) {
+            //全部是常量：从模板整体复制
+            std::string memcpy = "__aeabi_memcpy4";
+            Var *src = new Var(initLabel);
+            src->isArray = true;
+            gen.genParam(memcpy, array);
+            gen.genParam(memcpy, src);
+            gen.genParam(memcpy, bytes);
+            gen.genCallNoReturn(memcpy, 3);
+            return;
+        }
+        auto isZero = [](const std::shared_ptr<Expression> &e) {
+            return e->getType() == SyntaxType::NumericLiteralExpression &&
+                   std::dynamic_pointer_cast<NumericLiteralExpression>(e)->number == 0;
+        };
+        //未显式给出的元素都是零
+        std::size_t zeros = total - srcArray.size();
+        for (auto &elem : srcArray)
+            zeros += isZero(elem.second);
+        bool bulkZero = zeros >= bulkZeroMinElements;
+        if (bulkZero) {
+            //先整体清零，之后只写显式给出的非零元素
+            std::string memclr = "__aeabi_memclr4";
+            gen.genParam(memclr, array);
+            gen.genParam(memclr, bytes);
+            gen.genCallNoReturn(memclr, 2);
+            for (auto &[index, expr] : srcArray) {
+                if (isZero(expr))
+                    continue;
+                gen.genStore(expr->getVar(gen), array, gen.getConstVar(index));
+            }
+            return;
+        }
+        auto it = srcArray.begin();
+        for (std::size_t i = 0; i < total; i++) {
+            //temp[i] = t;
+            Var *t;
+            if (it != srcArray.end() && it->first == i)
+                t = (it++)->second->getVar(gen);
+            else
+                t = gen.getConstVar(0);
+            gen.genStore(t, array, gen.getConstVar(i));
+        }
+    }
+}
@@ -40,7 +40,7 @@ namespace kisyshot::ast {
     }
 
 
-    std::string Binary_op::opName[Binary_op::NumOps] = {"+", "-", "*", "/", "%", "<", ">", "==", "!=", ">=" "<="};
+    std::string Binary_op::opName[Binary_op::NumOps] = {"+", "-", "*", "/", "%", "<", ">", "==", "!=", ">=", "<=", "&", ">>"};
 
     //TODO: 把 = 号从二元式中分离出来
     Binary_op::Binary_op(OpCode c, Var *src_1, Var *src_2, Var *Dst) :
@@ -206,6 +206,39 @@ namespace kisyshot::ast {
         return InstructionType::EndFunc_;
     }
 
+    std::string VectorOp::opName[VectorOp::NumOps] = {"vld", "vst", "v+", "v-", "v*", "vdup", "vindex", "vsum"};
+
+    VectorOp::VectorOp(OpCode c, Var *src_1, Var *src_2, Var *dst) : Instruction(src_1, src_2, dst), code(c) {
+        numVars = 3;
+        assert(src_1 != nullptr && src_2 != nullptr && dst != nullptr);
+        assert(c != Dup && c != Index && c != Sum);
+    }
+
+    VectorOp::VectorOp(OpCode c, Var *src, Var *dst) : Instruction(src, dst), code(c) {
+        numVars = 2;
+        assert(src != nullptr && dst != nullptr);
+        assert(c == Dup || c == Index || c == Sum);
+    }
+
+    std::string VectorOp::toString() {
+        switch (code) {
+            case Load:
+                return dst->getName() + " = " + opName[code] + " " + src_1->getName() + "[" + src_2->getName() + "]";
+            case Store:
+                return opName[code] + " " + src_2->getName() + "[" + dst->getName() + "] = " + src_1->getName();
+            case Dup:
+            case Index:
+            case Sum:
+                return src_2->getName() + " = " + opName[code] + " " + src_1->getName();
+            default:
+                return dst->getName() + " = " + src_1->getName() + " " + opName[code] + " " + src_2->getName();
+        }
+    }
+
+    InstructionType VectorOp::getType() {
+        return InstructionType::Vector_;
+    }
+
     Instruction::Instruction() {}
 
     Instruction::Instruction(Var *src_1, Var *src_2) : src_1(src_1), src_2(src_2) {}
@@ -26,10 +26,28 @@ void ArmCodeGenerator::generateSpecial(Instruction * tac, Arms &arms) {
         arms.generateLoad(tac->dst, tac->src_1, tac->src_2);
     if (tac->getType() == InstructionType::Store_)
         arms.generateStore(tac->src_2, tac->dst, tac->src_1);
-    if (tac->getType() == InstructionType::Param_)
-        arms.generateParam(tac->src_1, paramNum, ctx->functions[((Param *)tac)->funName]->stackSize);
+    if (tac->getType() == InstructionType::Param_) {
+        auto last = (*liveListIterator).find(tac->src_1);
+        bool lastUse = last != (*liveListIterator).end() && last->second == tac;
+        arms.generateParam(tac->src_1, paramNum, lastUse);
+    }
+    if (tac->getType() == InstructionType::Vector_) {
+        auto op = ((VectorOp *)tac)->code;
+        if (op == VectorOp::Load)
+            arms.generateVectorLoad(tac->dst, tac->src_1, tac->src_2);
+        else if (op == VectorOp::Store)
+            arms.generateVectorStore(tac->src_2, tac->dst, tac->src_1);
+        else if (op == VectorOp::Dup)
+            arms.generateVectorDup(tac->src_2, tac->src_1);
+        else if (op == VectorOp::Index)
+            arms.generateVectorIndex(tac->src_2, tac->src_1);
+        else if (op == VectorOp::Sum)
+            arms.generateVectorSum(tac->src_2, tac->src_1);
+        else
+            arms.generateVectorOP(op, tac->dst, tac->src_1, tac->src_2);
+    }
     if (tac->getType() == InstructionType::BeginFunc_)
-        arms.generateBeginFunc(curFucLabel, ctx->functions[curFucLabel]->stackSize);
+        arms.generateBeginFunc(curFucLabel, ctx->functions[curFucLabel]->stackSize, loadGlobalBase);
     if (tac->getType() == InstructionType::Return_)
         arms.generateReturn(tac->src_1);
     if (tac->getType() == InstructionType::EndFunc_)
@@ -114,6 +132,10 @@ void ArmCodeGenerator::generateArmCode() {
                 liveListIterator = liveList.begin();
             else
                 liveListIterator++;
+            loadGlobalBase = false;
+            for (p = beginBlock; p != endBlock; p++)
+                if (arms.usesMergedGlobal(*p))
+                    loadGlobalBase = true;
             for (p = beginBlock; p != endBlock; p++) {
                 if ((*p)->getType() == InstructionType::Param_) {
                     paramNum++;
@@ -123,8 +145,17 @@ void ArmCodeGenerator::generateArmCode() {
                 generateSpecial(*p, arms);
                 for (varListIterator = (*liveListIterator).begin(); varListIterator != (*liveListIterator).end(); varListIterator++)
                     if ((*p) == (*varListIterator).second) {
-                        arms.generateDiscardVar((*varListIterator).first);
-                    }  
+                        // 实参要到call时才真正使用
+                        if ((*p)->getType() == InstructionType::Param_)
+                            argDiscards.push_back((*varListIterator).first);
+                        else
+                            arms.generateDiscardVar((*varListIterator).first);
+                    }
+                if ((*p)->getType() == InstructionType::Call_) {
+                    for (auto var : argDiscards)
+                        arms.generateDiscardVar(var);
+                    argDiscards.clear();
+                }
             }
         }
         if ((*p)->getType() == InstructionType::Label_)
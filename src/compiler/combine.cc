@@ -0,0 +1,241 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 变量在块内的值 base * k + c，base为空时是常量c；按32位补码运算，加减乘的重组都是精确的
+    struct Form {
+        Var * base;
+        int64_t k, c;
+    };
+
+    int64_t wrap(int64_t v) {
+        return (int32_t)(uint32_t)v;
+    }
+
+    // 参与化简的变量：不是数组和向量的标量
+    bool scalar(Var * var) {
+        return var->type != VarType::ConstVar && !var->isArray && !var->isVector;
+    }
+
+    // 常量操作数在代码生成时要先mov到寄存器，超出mov立即数范围时用两条指令
+    int constCost(Var * var) {
+        if (var->type != VarType::ConstVar)
+            return 0;
+        return var->value > 65535 || var->value < 0 ? 2 : 1;
+    }
+
+    int cost(Instruction * ins) {
+        int c = 1;
+        for (auto slot : useSlots(ins))
+            c += constCost(*slot);
+        return c;
+    }
+}
+
+bool Optimizer::combineInstructions(FunctionBody &fn) {
+    bool changed = false, branched = false;
+    for (auto block : fn.blocks)
+        if (fn.reachable[block->index])
+            changed = combineBlock(block, branched) || changed;
+    if (branched)
+        rebuild(fn);
+    return changed;
+}
+
+bool Optimizer::combineBlock(BasicBlock * block, bool &branched) {
+    /*
+     * 从块首往下记录各变量的值 base * k + c，运算的结果能用一条指令表示且不更贵时改写：
+     *   t1 = x + 1; t2 = t1 + 2       =>  t2 = x + 3
+     *   t1 = i + 1; t2 = t1 * 4; t3 = t2 - 4  =>  t3 = i * 4
+     *   x * 1, x + 0, x - x, 0 * y 等变成赋值，x * 2 变成 x + x，加法和乘法的常量放在右边；
+     * 和常量比较相等时把加上的常量移到另一边，两边都是常量的条件跳转变成GOTO或者删去
+     */
+    std::map<std::string, Form> forms;
+    auto formOf = [&forms](Var * var) {
+        if (var->type == VarType::ConstVar)
+            return Form{nullptr, 0, var->value};
+        auto it = forms.find(var->getName());
+        return it == forms.end() ? Form{var, 1, 0} : it->second;
+    };
+    // var重新定值后，以它为base的值都不再成立
+    auto kill = [&forms](Var * var) {
+        forms.erase(var->getName());
+        for (auto it = forms.begin(); it != forms.end();) {
+            if (it->second.base != nullptr && sameVar(it->second.base, var))
+                it = forms.erase(it);
+            else
+                it++;
+        }
+    };
+    auto linear = [](Binary_op::OpCode op, Form a, Form b, Form &r) {
+        bool sameBase = a.base == nullptr || b.base == nullptr || sameVar(a.base, b.base);
+        Var * base = a.base != nullptr ? a.base : b.base;
+        int64_t v;
+        switch (op) {
+            case Binary_op::Add:
+                if (!sameBase)
+                    return false;
+                r = {base, wrap(a.k + b.k), wrap(a.c + b.c)};
+                break;
+            case Binary_op::Sub:
+                if (!sameBase)
+                    return false;
+                r = {base, wrap(a.k - b.k), wrap(a.c - b.c)};
+                break;
+            case Binary_op::Mul:
+                if (a.base != nullptr && b.base != nullptr)
+                    return false;
+                if (a.base == nullptr)
+                    std::swap(a, b);
+                r = {a.base, wrap(a.k * b.c), wrap(a.c * b.c)};
+                break;
+            case Binary_op::Div:
+            case Binary_op::Mod:
+                if (b.base != nullptr)
+                    return false;
+                if (a.base == nullptr) {
+                    if (!foldBinary(op, a.c, b.c, v))
+                        return false;
+                    r = {nullptr, 0, v};
+                } else if (b.c == 1)
+                    r = op == Binary_op::Div ? a : Form{nullptr, 0, 0};
+                else
+                    return false;
+                break;
+            default:
+                return false;
+        }
+        if (r.k == 0)
+            r.base = nullptr;
+        return true;
+    };
+    // 用一条指令算出 d = f，做不到时返回nullptr
+    auto emit = [this](Form f, Var * d) -> Instruction * {
+        if (f.base == nullptr)
+            return (Instruction *)new Assign(gen.getConstVar(f.c), d);
+        if (f.k == 1 && f.c == 0)
+            return (Instruction *)new Assign(f.base, d);
+        if (f.c == 0 && f.k == 2)
+            return (Instruction *)new Binary_op(Binary_op::Add, f.base, f.base, d);
+        if (f.c == 0)
+            return (Instruction *)new Binary_op(Binary_op::Mul, f.base, gen.getConstVar(f.k), d);
+        if (f.k == 1 && f.c < 0 && f.c != INT32_MIN)
+            return (Instruction *)new Binary_op(Binary_op::Sub, f.base, gen.getConstVar(-f.c), d);
+        if (f.k == 1)
+            return (Instruction *)new Binary_op(Binary_op::Add, f.base, gen.getConstVar(f.c), d);
+        if (f.k == -1)
+            return (Instruction *)new Binary_op(Binary_op::Sub, gen.getConstVar(f.c), f.base, d);
+        return nullptr;
+    };
+    auto same = [](Instruction * a, Instruction * b) {
+        if (a->getType() != b->getType())
+            return false;
+        if (a->getType() == InstructionType::Binary_op_ && ((Binary_op *)a)->code != ((Binary_op *)b)->code)
+            return false;
+        auto x = useSlots(a), y = useSlots(b);
+        for (std::size_t i = 0; i < x.size(); i++)
+            if (!sameVar(*x[i], *y[i]))
+                return false;
+        return true;
+    };
+
+    bool changed = false;
+    auto &code = block->code;
+    for (auto it = code.begin(); it != code.end();) {
+        Instruction * ins = *it;
+        auto type = ins->getType();
+        if (type == InstructionType::Binary_op_ && scalar(ins->dst) &&
+            (ins->src_1->type == VarType::ConstVar || scalar(ins->src_1)) &&
+            (ins->src_2->type == VarType::ConstVar || scalar(ins->src_2))) {
+            auto op = ((Binary_op *)ins)->code;
+            if ((op == Binary_op::Add || op == Binary_op::Mul) && ins->src_1->type == VarType::ConstVar &&
+                ins->src_2->type != VarType::ConstVar) {
+                std::swap(ins->src_1, ins->src_2);
+                changed = true;
+            }
+            Form f;
+            Var * d = ins->dst;
+            if (linear(op, formOf(ins->src_1), formOf(ins->src_2), f)) {
+                Instruction * rewritten = emit(f, d);
+                if (rewritten != nullptr && cost(rewritten) <= cost(ins) && !same(rewritten, ins)) {
+                    *it = rewritten;
+                    changed = true;
+                }
+                kill(d);
+                if (f.base == nullptr || !sameVar(f.base, d))
+                    forms[d->getName()] = f;
+                it++;
+                continue;
+            }
+        } else if (type == InstructionType::Assign_ && scalar(ins->src_2) &&
+                   (ins->src_1->type == VarType::ConstVar || scalar(ins->src_1))) {
+            // 复制的值是常量或者另一个变量时直接用它，复制本身的代价不变
+            Form f = formOf(ins->src_1);
+            Instruction * rewritten = emit(f, ins->src_2);
+            if (rewritten != nullptr && rewritten->getType() == InstructionType::Assign_ && !same(rewritten, ins)) {
+                *it = rewritten;
+                changed = true;
+            }
+            kill(ins->src_2);
+            if (f.base == nullptr || !sameVar(f.base, ins->src_2))
+                forms[ins->src_2->getName()] = f;
+            it++;
+            continue;
+        } else if (type == InstructionType::CMP_ &&
+                   (ins->src_1->type == VarType::ConstVar || scalar(ins->src_1)) &&
+                   (ins->src_2->type == VarType::ConstVar || scalar(ins->src_2))) {
+            auto cmp = (CMP *)ins;
+            if (ins->src_1->type == VarType::ConstVar && ins->src_2->type != VarType::ConstVar) {
+                std::swap(ins->src_1, ins->src_2);
+                cmp->opType = swapRelation(cmp->opType);
+                changed = true;
+            }
+            Form a = formOf(ins->src_1), b = formOf(ins->src_2);
+            if (a.base == nullptr && b.base == nullptr) {
+                if (evalRelation(cmp->opType, a.c, b.c))
+                    *it = (Instruction *)new GOTO(cmp->label);
+                else
+                    code.erase(it);
+                changed = branched = true;
+                break;
+            }
+            // x + c == K 改成 x == K - c，按32位补码两边同减c仍然等价；
+            // x + c 可能回绕，大小比较只在 c 为0（直接比较x）时改，其余交给值域分析
+            bool exact = cmp->opType == TokenType::op_equaleq || cmp->opType == TokenType::op_exclaimeq;
+            if (a.base != nullptr && a.k == 1 && b.base == nullptr && (a.c != 0 || !sameVar(a.base, ins->src_1)) &&
+                (exact || a.c == 0)) {
+                ins->src_1 = a.base;
+                ins->src_2 = gen.getConstVar(wrap(b.c - a.c));
+                changed = true;
+            }
+        } else if (type == InstructionType::IfZ_ && scalar(ins->src_1)) {
+            Form a = formOf(ins->src_1);
+            if (a.base == nullptr) {
+                if (a.c == 0)
+                    *it = (Instruction *)new GOTO(((IfZ *)ins)->trueLabel);
+                else
+                    code.erase(it);
+                changed = branched = true;
+                break;
+            }
+            if (a.k == 1 && a.c == 0 && !sameVar(a.base, ins->src_1)) {
+                ins->src_1 = a.base;
+                changed = true;
+            } else if (a.k == 1 && a.c != 0 && a.c != INT32_MIN) {
+                *it = (Instruction *)new CMP(TokenType::op_equaleq, a.base, gen.getConstVar(-a.c),
+                                             ((IfZ *)ins)->trueLabel);
+                changed = true;
+            }
+        }
+        // 其余指令：定值的变量失去记录的值，调用可能改写全局变量，全部作废
+        if (type == InstructionType::Call_)
+            forms.clear();
+        if (defOf(*it) != nullptr)
+            kill(defOf(*it));
+        it++;
+    }
+    return changed;
+}
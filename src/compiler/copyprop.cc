@@ -0,0 +1,115 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+bool Optimizer::propagateCopies(FunctionBody &fn) {
+    /*
+     * 表达式的值总是先算到新的临时变量里：
+     *   t1 = a                      x = a + b
+     *   t2 = t1 + b         =>
+     *   x = t2
+     * t1的使用换成a，t2只被复制给x，直接把运算的结果写进x
+     */
+    bool changed = false;
+    auto temps = collectTemps(fn);
+    for (auto block : fn.blocks) {
+        if (!fn.reachable[block->index])
+            continue;
+        for (auto it = block->code.begin(); it != block->code.end();) {
+            auto next = std::next(it);
+            if ((*it)->getType() == InstructionType::Assign_ &&
+                (forwardCopy(block, it, temps) || coalesceCopy(block, it, temps)))
+                changed = true;
+            it = next;
+        }
+    }
+    return changed;
+}
+
+std::map<std::string, TempInfo> Optimizer::collectTemps(FunctionBody &fn) {
+    std::map<std::string, TempInfo> temps;
+    for (auto block : fn.blocks)
+        for (auto ins : block->code) {
+            for (auto slot : useSlots(ins))
+                if ((*slot)->type == VarType::TempVar) {
+                    temps[(*slot)->getName()].uses++;
+                    temps[(*slot)->getName()].blocks.insert(block);
+                }
+            if (defOf(ins) != nullptr && defOf(ins)->type == VarType::TempVar)
+                temps[defOf(ins)->getName()].defs++;
+        }
+    return temps;
+}
+
+bool Optimizer::forwardCopy(BasicBlock * block, std::list<Instruction *>::iterator copy,
+                            std::map<std::string, TempInfo> &temps) {
+    /*
+     * 块内的复制 t = x：t只在这里定值、只在这个块中使用，并且x在t最后一次使用之前不被重新定值时，
+     * 后面对t的使用都换成x，删去这条复制；x是全局变量时中间不能有调用。
+     * x是常量时使用处也要mov一次，代入没有好处
+     */
+    Var * t = (*copy)->src_2, * x = (*copy)->src_1;
+    if (t->type != VarType::TempVar || t->isVector || x->type == VarType::ConstVar || x->isArray || x->isVector)
+        return false;
+    auto &info = temps[t->getName()];
+    if (info.defs != 1 || info.blocks.size() > 1 || (info.blocks.size() == 1 && !info.blocks.count(block)))
+        return false;
+    auto last = copy;
+    for (auto it = std::next(copy); it != block->code.end(); it++)
+        for (auto slot : useSlots(*it))
+            if (sameVar(*slot, t))
+                last = it;
+    for (auto it = copy; it != last; it++) {
+        if (defOf(*it) != nullptr && sameVar(defOf(*it), x))
+            return false;
+        if ((*it)->getType() == InstructionType::Call_ && x->type == VarType::GlobalVar)
+            return false;
+    }
+    for (auto it = std::next(copy); it != std::next(last); it++)
+        for (auto slot : useSlots(*it))
+            if (sameVar(*slot, t))
+                *slot = x;
+    block->code.erase(copy);
+    if (x->type == VarType::TempVar)
+        temps[x->getName()].uses += info.uses - 1;
+    info = TempInfo();
+    return true;
+}
+
+bool Optimizer::coalesceCopy(BasicBlock * block, std::list<Instruction *>::iterator copy,
+                             std::map<std::string, TempInfo> &temps) {
+    /*
+     * 复制 x = t：t在同一个块中由运算、读取、赋值或调用定值，这条复制是t唯一的使用，
+     * 并且两条指令之间没有用到或者改写x（x是全局变量时中间也不能有调用），
+     * 让定值直接写x，删去复制
+     */
+    Var * x = (*copy)->src_2, * t = (*copy)->src_1;
+    if (t->type != VarType::TempVar || t->isVector || x->isArray || x->isVector)
+        return false;
+    auto &info = temps[t->getName()];
+    if (info.defs != 1 || info.uses != 1)
+        return false;
+    for (auto it = copy; it != block->code.begin();) {
+        it--;
+        Instruction * ins = *it;
+        Var * d = defOf(ins);
+        if (d != nullptr && sameVar(d, t)) {
+            auto type = ins->getType();
+            if (type != InstructionType::Binary_op_ && type != InstructionType::Load_ &&
+                type != InstructionType::Assign_ && type != InstructionType::Call_)
+                return false;
+            *defSlot(ins) = x;
+            block->code.erase(copy);
+            info = TempInfo();
+            return true;
+        }
+        if ((d != nullptr && sameVar(d, x)) || (ins->getType() == InstructionType::Call_ && x->type == VarType::GlobalVar))
+            return false;
+        for (auto slot : useSlots(ins))
+            if (sameVar(*slot, x))
+                return false;
+    }
+    return false;
+}
@@ -0,0 +1,140 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 参与活跃分析的变量：临时变量和标量局部变量，全局变量在函数外可见，总是活跃
+    bool tracked(Var * var) {
+        return var != nullptr && (var->type == VarType::TempVar || isScalarLocal(var));
+    }
+
+    // 没有副作用、结果不用时可以删掉的指令
+    bool removable(Instruction * ins) {
+        auto type = ins->getType();
+        return type == InstructionType::Binary_op_ || type == InstructionType::Assign_ ||
+               type == InstructionType::Load_;
+    }
+}
+
+bool Optimizer::eliminateDeadCode(FunctionBody &fn) {
+    // 只删除不跳转的指令，块的划分和前驱后继不变
+    bool changed = false;
+    bool progress = true;
+    while (progress) {
+        progress = eliminateDeadStores(fn);
+        progress = eliminateDeadDefs(fn) || progress;
+        changed = changed || progress;
+    }
+    return changed;
+}
+
+bool Optimizer::eliminateDeadDefs(FunctionBody &fn) {
+    /*
+     * 求强活跃变量：结果不活跃的Binary_op/Assign/Load本身要删去，其中的使用不让变量活跃，
+     * 所以一条死的运算链一次就能找全。块的in = 从out出发逆着走一遍块中的指令，
+     * out = 所有后继的in之并；in变化时把前驱放回工作表。最后在每个块中逆着走一遍删去这些指令
+     */
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    std::map<std::string, int> ids;
+    std::map<Var *, int> cache;
+    auto id = [&](Var * var) {
+        auto known = cache.find(var);
+        if (known != cache.end())
+            return known->second;
+        auto it = ids.emplace(var->getName(), ids.size()).first;
+        return cache[var] = it->second;
+    };
+    for (auto block : blocks)
+        for (auto ins : block->code) {
+            for (auto slot : useSlots(ins))
+                if (tracked(*slot))
+                    id(*slot);
+            if (tracked(defOf(ins)))
+                id(defOf(ins));
+        }
+    int m = ids.size();
+    // 逆着走一遍块，erase时顺便删去死的指令
+    auto transfer = [&](BasicBlock * block, std::vector<bool> &live, bool erase) {
+        auto &code = block->code;
+        bool changed = false;
+        for (auto it = code.end(); it != code.begin();) {
+            it--;
+            Var * d = defOf(*it);
+            if (tracked(d) && !live[id(d)] && removable(*it)) {
+                if (erase) {
+                    it = code.erase(it);
+                    changed = true;
+                }
+                continue;
+            }
+            if (tracked(d))
+                live[id(d)] = false;
+            for (auto slot : useSlots(*it))
+                if (tracked(*slot))
+                    live[id(*slot)] = true;
+        }
+        return changed;
+    };
+    std::vector<std::vector<bool>> in(n, std::vector<bool>(m, false)), out(n, std::vector<bool>(m, false));
+    std::vector<bool> queued(n, true);
+    std::vector<int> work;
+    for (int i = 0; i < n; i++)
+        work.push_back(i);
+    while (!work.empty()) {
+        int i = work.back();
+        work.pop_back();
+        queued[i] = false;
+        std::vector<bool> live(m, false);
+        for (auto succ : blocks[i]->succs)
+            for (int v = 0; v < m; v++)
+                if (in[succ->index][v])
+                    live[v] = true;
+        out[i] = live;
+        transfer(blocks[i], live, false);
+        if (live == in[i])
+            continue;
+        in[i] = live;
+        for (auto pred : blocks[i]->preds)
+            if (!queued[pred->index]) {
+                queued[pred->index] = true;
+                work.push_back(pred->index);
+            }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < n; i++)
+        changed = transfer(blocks[i], out[i], true) || changed;
+    return changed;
+}
+
+bool Optimizer::eliminateDeadStores(FunctionBody &fn) {
+    // 局部数组除了作为Store的目标之外没有出现过（没有读、没有传给函数、没有取地址），对它的写都是多余的
+    std::map<std::string, bool> read;
+    for (auto block : fn.blocks)
+        for (auto ins : block->code) {
+            std::vector<Var **> slots = useSlots(ins);
+            if (defSlot(ins) != nullptr)
+                slots.push_back(defSlot(ins));
+            for (auto slot : slots) {
+                Var * var = *slot;
+                if (var == nullptr || var->type != VarType::LocalVar || !var->isArray || var->isParam)
+                    continue;
+                bool stored = ins->getType() == InstructionType::Store_ && slot == &ins->src_2;
+                read[var->getName()] = read[var->getName()] || !stored;
+            }
+        }
+    bool changed = false;
+    for (auto block : fn.blocks)
+        for (auto it = block->code.begin(); it != block->code.end();) {
+            if ((*it)->getType() == InstructionType::Store_ && read.count((*it)->src_2->getName()) &&
+                !read[(*it)->src_2->getName()]) {
+                it = block->code.erase(it);
+                changed = true;
+            } else
+                it++;
+        }
+    return changed;
+}
@@ -0,0 +1,325 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 编译期求值时直接实现的库函数：取模和数组清零
+    const std::string idivmod = "__aeabi_idivmod";
+    const std::string memclr = "__aeabi_memclr4";
+
+    // 解释执行时能保存在帧里的变量：局部标量和临时变量
+    bool frameScalar(Var * var) {
+        return (var->type == VarType::LocalVar || var->type == VarType::TempVar) && !var->isArray && !var->isVector;
+    }
+
+    // 关系运算对应的比较
+    TokenType relationOf(Binary_op::OpCode op) {
+        switch (op) {
+            case Binary_op::Less: return TokenType::op_less;
+            case Binary_op::Greater: return TokenType::op_greater;
+            case Binary_op::Equaleq: return TokenType::op_equaleq;
+            case Binary_op::Exclaimeq: return TokenType::op_exclaimeq;
+            case Binary_op::Greatereq: return TokenType::op_greatereq;
+            default: return TokenType::op_lesseq;
+        }
+    }
+}
+
+void Optimizer::collectPureFunctions() {
+    /*
+     * 各函数都还没有优化时复制一份代码：后面的趟会就地改写指令，调用方优化时被调函数可能已经改过了。
+     * 纯函数取最大不动点：不出现全局变量、字符串和形参数组，调用的只有纯函数、取模和数组清零
+     */
+    std::string curFunc;
+    for (auto p = gen.code.begin(); p != gen.code.end(); p++) {
+        if ((*p)->getType() == InstructionType::Label_ && ((Label *)(*p))->label[0] != '.')
+            curFunc = ((Label *)(*p))->label;
+        if ((*p)->getType() != InstructionType::BeginFunc_)
+            continue;
+        auto &body = bodies[curFunc];
+        std::map<std::string, std::string> labels;
+        for (p++; (*p)->getType() != InstructionType::EndFunc_; p++) {
+            Instruction * ins = *p;
+            if (ins->getType() == InstructionType::Label_) {
+                body.labels[((Label *)ins)->label] = body.code.size();
+                continue;
+            }
+            // 临时变量映射到自己，复制的指令和原来的读写同样的变量
+            std::map<Var *, Var *> temps;
+            auto slots = useSlots(ins);
+            if (defSlot(ins) != nullptr)
+                slots.push_back(defSlot(ins));
+            for (auto slot : slots)
+                temps[*slot] = *slot;
+            body.code.push_back(cloneInstruction(ins, temps, labels));
+        }
+    }
+
+    for (auto &[name, body] : bodies)
+        pureFunctions.insert(name);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = pureFunctions.begin(); it != pureFunctions.end();) {
+            bool pure = true;
+            for (auto ins : bodies[*it].code) {
+                auto slots = useSlots(ins);
+                if (defSlot(ins) != nullptr)
+                    slots.push_back(defSlot(ins));
+                for (auto slot : slots)
+                    if ((*slot)->type == VarType::GlobalVar || (*slot)->type == VarType::StringVar ||
+                        ((*slot)->isArray && (*slot)->isParam))
+                        pure = false;
+                if (ins->getType() == InstructionType::Call_) {
+                    auto &callee = ((Call *)ins)->funLabel;
+                    if (callee != idivmod && callee != memclr && !pureFunctions.count(callee))
+                        pure = false;
+                }
+            }
+            if (pure) {
+                it++;
+                continue;
+            }
+            it = pureFunctions.erase(it);
+            changed = true;
+        }
+    }
+}
+
+bool Optimizer::evaluateCalls(FunctionBody &fn) {
+    /*
+     * 参数都是常量的纯函数调用在编译期解释执行：
+     *   parameter fib 20
+     *   t = call fib, 1        =>   t = 6765
+     * 超出指令数、数组大小或调用深度的限制，以及遇到除零、越界、未初始化的读时放弃
+     */
+    bool changed = false;
+    for (auto block : fn.blocks) {
+        if (!fn.reachable[block->index])
+            continue;
+        auto &code = block->code;
+        for (auto next = code.begin(); next != code.end();) {
+            auto it = next++;
+            if ((*it)->getType() != InstructionType::Call_)
+                continue;
+            auto call = (Call *)(*it);
+            if (!pureFunctions.count(call->funLabel))
+                continue;
+            // 前面紧挨着的n条Param，参数是变量时在块内往前找它被赋的常量
+            std::vector<int64_t> args(call->n);
+            auto first = it;
+            bool constant = true;
+            for (int i = call->n - 1; i >= 0 && constant; i--) {
+                if (first == code.begin() || (*std::prev(first))->getType() != InstructionType::Param_ ||
+                    ((Param *)(*std::prev(first)))->funName != call->funLabel) {
+                    constant = false;
+                    break;
+                }
+                first--;
+                Var * arg = (*first)->src_1;
+                if (arg->type == VarType::ConstVar) {
+                    args[i] = arg->value;
+                    continue;
+                }
+                constant = false;
+                if (!frameScalar(arg))
+                    break;
+                for (auto p = first; p != code.begin();) {
+                    p--;
+                    Var * d = defOf(*p);
+                    if (d != nullptr && sameVar(d, arg)) {
+                        if ((*p)->getType() == InstructionType::Assign_ && (*p)->src_1->type == VarType::ConstVar) {
+                            args[i] = (*p)->src_1->value;
+                            constant = true;
+                        }
+                        break;
+                    }
+                }
+            }
+            if (!constant || unevaluable.count({call->funLabel, args}))
+                continue;
+            int64_t result, steps = std::min<int64_t>(evalMaxSteps, evalBudget), cells = evalMaxCells;
+            bool ok = interpret(call->funLabel, args, result, steps, cells, 0);
+            evalBudget -= std::min<int64_t>(evalMaxSteps, evalBudget) - std::max<int64_t>(steps, 0);
+            if (!ok) {
+                unevaluable.insert({call->funLabel, args});
+                continue;
+            }
+            code.erase(first, it);
+            if ((*it)->numVars == 1)
+                *it = (Instruction *)new Assign(gen.getConstVar(result), (*it)->src_1);
+            else
+                code.erase(it);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::interpret(const std::string &fun, const std::vector<int64_t> &args, int64_t &result,
+                          int64_t &steps, int64_t &cells, int depth) {
+    auto memo = evaluated.find({fun, args});
+    if (memo != evaluated.end()) {
+        result = memo->second;
+        return true;
+    }
+    auto &params = ctx->functions.at(fun)->params;
+    if (depth > evalMaxDepth || params.size() != args.size())
+        return false;
+    auto &body = bodies.at(fun);
+    std::map<std::string, int64_t> scalars;
+    std::map<std::string, std::vector<int32_t>> arrays;
+    for (std::size_t i = 0; i < args.size(); i++)
+        scalars[params[i]->varName->mangledId] = args[i];
+    int64_t allocated = 0;
+
+    auto value = [&scalars](Var * var, int64_t &x) {
+        if (var->type == VarType::ConstVar) {
+            x = var->value;
+            return true;
+        }
+        if (!frameScalar(var))
+            return false;
+        auto it = scalars.find(var->getName());
+        if (it == scalars.end())
+            return false;
+        x = it->second;
+        return true;
+    };
+    auto assign = [&scalars](Var * var, int64_t x) {
+        if (!frameScalar(var))
+            return false;
+        scalars[var->getName()] = x;
+        return true;
+    };
+    // 局部数组第一次用到时按定义的大小分配，计入数组大小的限制
+    auto array = [&](Var * var) -> std::vector<int32_t> * {
+        if (var->type != VarType::LocalVar || !var->isArray || var->isParam)
+            return nullptr;
+        auto it = arrays.find(var->getName());
+        if (it != arrays.end())
+            return &it->second;
+        auto def = ctx->symbols.find(var->getName());
+        if (def == ctx->symbols.end() || def->second->accumulation.empty())
+            return nullptr;
+        int64_t size = def->second->accumulation.front();
+        if (size > cells)
+            return nullptr;
+        cells -= size;
+        allocated += size;
+        return &(arrays[var->getName()] = std::vector<int32_t>(size, 0));
+    };
+    auto element = [&](Var * base, Var * index) -> int32_t * {
+        auto a = array(base);
+        int64_t i;
+        if (a == nullptr || !value(index, i) || i < 0 || i >= (int64_t)a->size())
+            return nullptr;
+        return &(*a)[i];
+    };
+
+    auto run = [&]() {
+        std::vector<Var *> pending;
+        auto &code = body.code;
+        std::size_t pc = 0;
+        while (pc < code.size()) {
+            if (--steps < 0)
+                return false;
+            Instruction * ins = code[pc++];
+            int64_t a, b, r;
+            switch (ins->getType()) {
+                case InstructionType::Assign_:
+                    if (!value(ins->src_1, a) || !assign(ins->src_2, a))
+                        return false;
+                    break;
+                case InstructionType::Binary_op_: {
+                    auto op = ((Binary_op *)ins)->code;
+                    if (!value(ins->src_1, a) || !value(ins->src_2, b))
+                        return false;
+                    if (op >= Binary_op::Less && op <= Binary_op::Lesseq)
+                        r = evalRelation(relationOf(op), a, b);
+                    else if (!foldBinary(op, a, b, r))
+                        return false;
+                    if (!assign(ins->dst, r))
+                        return false;
+                    break;
+                }
+                case InstructionType::Load_: {
+                    int32_t * e = element(ins->src_1, ins->src_2);
+                    if (e == nullptr || !assign(ins->dst, *e))
+                        return false;
+                    break;
+                }
+                case InstructionType::Store_: {
+                    int32_t * e = element(ins->src_2, ins->dst);
+                    if (e == nullptr || !value(ins->src_1, a))
+                        return false;
+                    *e = a;
+                    break;
+                }
+                case InstructionType::Param_:
+                    pending.push_back(ins->src_1);
+                    break;
+                case InstructionType::Call_: {
+                    auto call = (Call *)ins;
+                    if ((int)pending.size() < call->n)
+                        return false;
+                    std::vector<Var *> actual(pending.end() - call->n, pending.end());
+                    pending.resize(pending.size() - call->n);
+                    r = 0;
+                    if (call->funLabel == idivmod) {
+                        if (actual.size() != 2 || !value(actual[0], a) || !value(actual[1], b) ||
+                            !foldBinary(Binary_op::Mod, a, b, r))
+                            return false;
+                    } else if (call->funLabel == memclr) {
+                        auto dest = actual.size() == 2 ? array(actual[0]) : nullptr;
+                        if (dest == nullptr || !value(actual[1], b) || b < 0 || b / 4 > (int64_t)dest->size())
+                            return false;
+                        std::fill(dest->begin(), dest->begin() + b / 4, 0);
+                    } else {
+                        std::vector<int64_t> values(actual.size());
+                        for (std::size_t i = 0; i < actual.size(); i++)
+                            if (!value(actual[i], values[i]))
+                                return false;
+                        if (!pureFunctions.count(call->funLabel) ||
+                            !interpret(call->funLabel, values, r, steps, cells, depth + 1))
+                            return false;
+                    }
+                    if (ins->numVars == 1 && !assign(ins->src_1, r))
+                        return false;
+                    break;
+                }
+                case InstructionType::Return_:
+                    result = 0;
+                    return ins->numVars == 0 || value(ins->src_1, result);
+                case InstructionType::GOTO_:
+                    pc = body.labels.at(((GOTO *)ins)->label);
+                    break;
+                case InstructionType::IfZ_:
+                    if (!value(ins->src_1, a))
+                        return false;
+                    if (a == 0)
+                        pc = body.labels.at(((IfZ *)ins)->trueLabel);
+                    break;
+                case InstructionType::CMP_:
+                    if (!value(ins->src_1, a) || !value(ins->src_2, b))
+                        return false;
+                    if (evalRelation(((CMP *)ins)->opType, a, b))
+                        pc = body.labels.at(((CMP *)ins)->label);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        // 非void函数没有执行到return，结果未定义
+        return false;
+    };
+    bool ok = run();
+    // 返回时本次调用的局部数组释放
+    cells += allocated;
+    if (ok)
+        evaluated[{fun, args}] = result;
+    return ok;
+}
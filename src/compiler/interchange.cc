@@ -0,0 +1,391 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <compiler/affine.h>
+#include <algorithm>
+#include <cstdlib>
+#include <numeric>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 循环体中的一次数组访问，下标中i和j的系数分别是ai和aj
+    struct Access {
+        Var * base;
+        Affine offset;
+        bool store;
+        int64_t ai, aj;
+    };
+
+    // 逐次执行的步长对应的访存代价：不变最好，相邻元素其次，跨行最差
+    int strideCost(int64_t stride) {
+        if (stride == 0)
+            return 0;
+        return std::llabs(stride) == 1 ? 1 : 4;
+    }
+
+    /*
+     * 两次访问的地址相同当且仅当 ai·Δi + aj·Δj = delta，Δ是两次迭代的 (i, j) 之差。
+     * Δi和Δj都不为0且符号相反时，两次迭代的先后在交换后颠倒。
+     * ti、tj是两层循环的迭代次数，未知时为-1
+     */
+    bool reversesDependence(int64_t ai, int64_t aj, int64_t delta, int64_t ti, int64_t tj) {
+        const int64_t maxSearch = 4096;
+        auto within = [](int64_t d, int64_t t) {
+            return t < 0 || std::llabs(d) < t;
+        };
+        if (ai == 0 && aj == 0)
+            return delta == 0;
+        if (ai == 0)
+            return delta % aj == 0 && delta != 0 && within(delta / aj, tj) && ti != 1;
+        if (aj == 0)
+            return delta % ai == 0 && delta != 0 && within(delta / ai, ti) && tj != 1;
+        if (ti >= 0 && ti <= maxSearch) {
+            for (int64_t di = 1 - ti; di < ti; di++) {
+                int64_t rest = delta - ai * di;
+                if (di == 0 || rest % aj != 0)
+                    continue;
+                int64_t dj = rest / aj;
+                if (dj != 0 && (dj > 0) != (di > 0) && within(dj, tj))
+                    return true;
+            }
+            return false;
+        }
+        if (tj >= 0 && tj <= maxSearch)
+            return reversesDependence(aj, ai, delta, tj, ti);
+        return delta % std::gcd(ai, aj) == 0;
+    }
+
+    // 计数循环的迭代次数，初值或界不是常量时返回-1
+    int64_t tripCount(Var * init, Var * bound, int64_t step, TokenType cont) {
+        if (init->type != VarType::ConstVar || bound->type != VarType::ConstVar)
+            return -1;
+        int64_t span;
+        switch (cont) {
+            case TokenType::op_less: span = bound->value - init->value; break;
+            case TokenType::op_lesseq: span = bound->value - init->value + 1; break;
+            case TokenType::op_greater: span = init->value - bound->value; break;
+            case TokenType::op_greatereq: span = init->value - bound->value + 1; break;
+            default: return -1;
+        }
+        int64_t stride = std::llabs(step);
+        return span <= 0 ? 0 : (span + stride - 1) / stride;
+    }
+}
+
+bool Optimizer::interchangeLoops(FunctionBody &fn) {
+    std::set<std::string> done;
+    bool changed = false;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (auto &loop : findLoops(fn)) {
+            if (done.count(loop.header->label))
+                continue;
+            done.insert(loop.header->label);
+            if (interchangeLoop(fn, loop, done)) {
+                rebuild(fn);
+                changed = progress = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::usedBeforeDef(FunctionBody &fn, BasicBlock * start, Var * var) {
+    std::set<BasicBlock *> visited;
+    std::vector<BasicBlock *> work{start};
+    while (!work.empty()) {
+        auto block = work.back();
+        work.pop_back();
+        if (!visited.insert(block).second)
+            continue;
+        bool killed = false;
+        for (auto ins : block->code) {
+            for (auto slot : useSlots(ins))
+                if (sameVar(*slot, var))
+                    return true;
+            if (defOf(ins) != nullptr && sameVar(defOf(ins), var)) {
+                killed = true;
+                break;
+            }
+        }
+        if (!killed)
+            work.insert(work.end(), block->succs.begin(), block->succs.end());
+    }
+    return false;
+}
+
+bool Optimizer::interchangeLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done) {
+    /*
+     * 完美嵌套的两层计数循环，内层的初值和两层的界都与外层无关：
+     * H1: if i !op n GOTO E1               H1: j = b
+     *     j = b                            H2: if j !op m GOTO E1
+     * H2: if j !op m GOTO E2                   i = a
+     *     body ...                ==>      HI: if i !op n GOTO E2
+     *     j = j + c                            body ...
+     *     GOTO H2                              i = i + d
+     * E2: i = i + d                            GOTO HI
+     *     GOTO H1                          E2: j = j + c
+     * E1:                                      GOTO H2
+     *                                      E1:
+     * 交换后离开循环时i和j的值不同，所以要求它们在E1之后先定值再使用
+     */
+    auto &blocks = fn.blocks;
+    BasicBlock * outerHead = loop.header;
+    BasicBlock * outerLatch = loop.latch;
+    if (outerLatch == nullptr || outerHead->label.empty())
+        return false;
+    int h1 = outerHead->index, l1 = outerLatch->index;
+    if (h1 == 0 || l1 < h1 + 3 || (int)loop.blocks.size() != l1 - h1 + 1 || l1 + 1 >= (int)blocks.size())
+        return false;
+    for (int i = h1; i <= l1; i++)
+        if (!loop.blocks.count(blocks[i]))
+            return false;
+    for (auto pred : outerHead->preds)
+        if (pred != outerLatch && pred->index != h1 - 1)
+            return false;
+    BasicBlock * exit = blocks[l1 + 1];
+    Instruction * outerTest = outerHead->code.empty() ? nullptr : outerHead->code.back();
+    if (outerTest == nullptr || outerTest->getType() != InstructionType::CMP_ || branchLabel(outerTest) != exit->label)
+        return false;
+
+    // 内层循环的初值
+    BasicBlock * pre = blocks[h1 + 1];
+    if (!pre->label.empty() || pre->code.size() != 1 || pre->code.front()->getType() != InstructionType::Assign_ ||
+        pre->code.front()->src_1->type != VarType::ConstVar)
+        return false;
+    Var * j = pre->code.front()->src_2;
+
+    // 内层循环
+    BasicBlock * innerHead = blocks[h1 + 2];
+    CountedLoop inner;
+    bool found = false;
+    for (auto &candidate : findLoops(fn))
+        if (candidate.header == innerHead) {
+            found = matchCountedLoop(fn, candidate, inner);
+            break;
+        }
+    if (!found || !sameVar(inner.iv, j) || inner.l + 1 != l1 || inner.hasCall)
+        return false;
+    BasicBlock * innerLatch = blocks[inner.l];
+    auto updateAtEnd = [](BasicBlock * latch, Instruction * inc, Instruction * ivDef) {
+        auto it = std::prev(latch->code.end());
+        if (it == latch->code.begin() || *--it != ivDef)
+            return false;
+        return inc == ivDef || (it != latch->code.begin() && *--it == inc);
+    };
+    if (!updateAtEnd(innerLatch, inner.inc, inner.ivDef))
+        return false;
+
+    // 外层的latch只更新i：t = i ± d; i = t 或 i = i ± d
+    auto &latchCode = outerLatch->code;
+    if (latchCode.size() < 2 || latchCode.size() > 3 || latchCode.back()->getType() != InstructionType::GOTO_)
+        return false;
+    Instruction * ivDef = *std::prev(latchCode.end(), 2);
+    Instruction * inc = latchCode.size() == 3 ? latchCode.front() : ivDef;
+    Var * i = defOf(ivDef);
+    if (i == nullptr || !isScalarLocal(i) || sameVar(i, j) || inc->getType() != InstructionType::Binary_op_)
+        return false;
+    if (inc != ivDef && (ivDef->getType() != InstructionType::Assign_ || ivDef->src_1 != inc->dst ||
+                         inc->dst->type != VarType::TempVar))
+        return false;
+    auto op = ((Binary_op *)inc)->code;
+    int64_t stepI;
+    if (op == Binary_op::Add && sameVar(inc->src_1, i) && inc->src_2->type == VarType::ConstVar)
+        stepI = inc->src_2->value;
+    else if (op == Binary_op::Add && sameVar(inc->src_2, i) && inc->src_1->type == VarType::ConstVar)
+        stepI = inc->src_1->value;
+    else if (op == Binary_op::Sub && sameVar(inc->src_1, i) && inc->src_2->type == VarType::ConstVar)
+        stepI = -inc->src_2->value;
+    else
+        return false;
+    TokenType contI = invertRelation(((CMP *)outerTest)->opType);
+    Var * boundI;
+    if (sameVar(outerTest->src_1, i))
+        boundI = outerTest->src_2;
+    else if (sameVar(outerTest->src_2, i)) {
+        boundI = outerTest->src_1;
+        contI = swapRelation(contI);
+    } else
+        return false;
+    if (!((stepI > 0 && (contI == TokenType::op_less || contI == TokenType::op_lesseq)) ||
+          (stepI < 0 && (contI == TokenType::op_greater || contI == TokenType::op_greatereq))))
+        return false;
+
+    // 循环中只能给临时变量、i、j和归约变量赋值；两层的界都不能依赖嵌套中定值的变量
+    std::vector<Reduction> reductions = matchReductions(fn, inner);
+    auto definedInNest = [&](Var * var) {
+        if (sameVar(var, i) || sameVar(var, j))
+            return true;
+        for (auto &[v, n] : inner.defs)
+            if (sameVar(v, var))
+                return true;
+        return false;
+    };
+    for (auto &[var, n] : inner.defs)
+        if (var->type != VarType::TempVar && !sameVar(var, j) &&
+            std::none_of(reductions.begin(), reductions.end(), [var](const Reduction &r) { return sameVar(r.var, var); }))
+            return false;
+    for (auto head : {outerHead, innerHead}) {
+        Var * iv = head == outerHead ? i : j;
+        for (auto ins : head->code) {
+            if (ins != head->code.back() && defOf(ins)->type != VarType::TempVar)
+                return false;
+            for (auto slot : useSlots(ins)) {
+                Var * var = *slot;
+                if (var->type != VarType::TempVar && var->type != VarType::ConstVar && !sameVar(var, iv) &&
+                    (var->isArray || definedInNest(var)))
+                    return false;
+            }
+        }
+    }
+
+    // i进入循环前的初值：沿着唯一前驱向上找最后一次定值
+    Var * initI = nullptr;
+    BasicBlock * b = blocks[h1 - 1];
+    for (int depth = 0; depth < 16 && b != nullptr && initI == nullptr; depth++) {
+        Instruction * last = nullptr;
+        for (auto ins : b->code)
+            if (defOf(ins) != nullptr && sameVar(defOf(ins), i))
+                last = ins;
+        if (last != nullptr) {
+            if (last->getType() != InstructionType::Assign_ || last->src_1->type != VarType::ConstVar)
+                return false;
+            initI = last->src_1;
+        }
+        b = b->preds.size() == 1 && b->preds[0]->index < b->index ? b->preds[0] : nullptr;
+    }
+    if (initI == nullptr || usedBeforeDef(fn, exit, i) || usedBeforeDef(fn, exit, j))
+        return false;
+
+    // 循环体中数组下标的仿射形式，在多个块中定值的临时变量不是仿射的
+    std::map<Var *, int> defBlock;
+    for (int b = inner.h + 1; b <= inner.l; b++)
+        for (auto ins : blocks[b]->code)
+            if (Var * d = defOf(ins))
+                defBlock[d] = defBlock.count(d) && defBlock[d] != b ? -1 : b;
+    std::map<Var *, Affine> forms;
+    int opaque = 0;
+    auto formOf = [&](Var * var) {
+        Affine a;
+        if (var->type == VarType::ConstVar)
+            a.c = var->value;
+        else if (var->type == VarType::TempVar) {
+            if (forms.count(var) && defBlock[var] != -1)
+                a = forms[var];
+            else
+                a.ok = false;
+        } else if (var->isArray || (definedInNest(var) && !sameVar(var, i) && !sameVar(var, j)))
+            a.ok = false;
+        else
+            a.terms[var->getName()] = 1;
+        return a;
+    };
+    std::vector<Access> accesses;
+    for (int b = inner.h + 1; b <= inner.l; b++)
+        for (auto ins : blocks[b]->code) {
+            auto type = ins->getType();
+            if (type == InstructionType::Load_ || type == InstructionType::Store_) {
+                bool store = type == InstructionType::Store_;
+                Var * base = store ? ins->src_2 : ins->src_1;
+                if (base->type == VarType::TempVar)
+                    return false;
+                Affine f = formOf(store ? ins->dst : ins->src_2);
+                int64_t ai = f.terms.count(i->getName()) ? f.terms[i->getName()] : 0;
+                int64_t aj = f.terms.count(j->getName()) ? f.terms[j->getName()] : 0;
+                f.terms.erase(i->getName());
+                f.terms.erase(j->getName());
+                accesses.push_back(Access{base, f, store, ai, aj});
+            }
+            Var * d = defOf(ins);
+            if (d == nullptr || d->type != VarType::TempVar)
+                continue;
+            Affine f;
+            if (type == InstructionType::Assign_)
+                f = formOf(ins->src_1);
+            else if (type == InstructionType::Binary_op_ && !ins->src_1->isArray) {
+                Affine a = formOf(ins->src_1), b = formOf(ins->src_2);
+                auto code = ((Binary_op *)ins)->code;
+                bool aConst = a.ok && a.terms.empty(), bConst = b.ok && b.terms.empty();
+                if (!a.ok || !b.ok)
+                    f.ok = false;
+                else if (code == Binary_op::Add)
+                    f = combine(a, b, 1);
+                else if (code == Binary_op::Sub)
+                    f = combine(a, b, -1);
+                else if (code == Binary_op::Mul && aConst)
+                    f = scaled(b, a.c);
+                else if (code == Binary_op::Mul && bConst)
+                    f = scaled(a, b.c);
+                else
+                    f.ok = false;
+            } else
+                f.ok = false;
+            // 不能表示成仿射形式的值用一个不透明的名字代表
+            if (!f.ok) {
+                f = Affine();
+                f.terms["#" + std::to_string(opaque++)] = 1;
+            }
+            forms[d] = f;
+        }
+
+    // 依赖检查：可能重叠的两次访问中有写，且交换后先后次序可能颠倒时不能交换
+    int64_t ti = tripCount(initI, boundI, stepI, contI);
+    int64_t tj = tripCount(pre->code.front()->src_1, inner.bound, inner.step, inner.cont);
+    for (int a = 0; a < (int)accesses.size(); a++)
+        for (int b = a; b < (int)accesses.size(); b++) {
+            Access &x = accesses[a], &y = accesses[b];
+            if ((!x.store && !y.store) || !mayAlias(x.base, y.base))
+                continue;
+            if (!x.offset.ok || !y.offset.ok || !sameVar(x.base, y.base) || x.offset.terms != y.offset.terms ||
+                x.ai != y.ai || x.aj != y.aj)
+                return false;
+            for (auto &[name, coef] : x.offset.terms)
+                if (name[0] == '#')
+                    return false;
+            if (reversesDependence(x.ai * stepI, x.aj * inner.step, x.offset.c - y.offset.c, ti, tj))
+                return false;
+        }
+
+    // 交换后最内层的访问更连续时才交换
+    int costI = 0, costJ = 0;
+    for (auto &access : accesses) {
+        costI += strideCost(access.ai * stepI);
+        costJ += strideCost(access.aj * inner.step);
+    }
+    if (costI >= costJ)
+        return false;
+
+    auto initJ = new BasicBlock();
+    initJ->label = outerHead->label;
+    initJ->code.swap(pre->code);
+    auto initIBlock = new BasicBlock();
+    initIBlock->code.push_back((Instruction *)new Assign(initI, i));
+    outerHead->label = gen.newLabel();
+    branchLabel(outerTest) = outerLatch->label;
+    branchLabel(innerHead->code.back()) = exit->label;
+    // 两个归纳变量的更新互换位置
+    std::list<Instruction *> incI(latchCode.begin(), std::prev(latchCode.end()));
+    auto &innerCode = innerLatch->code;
+    auto firstJ = std::prev(innerCode.end(), inner.inc == inner.ivDef ? 2 : 3);
+    std::list<Instruction *> incJ(firstJ, std::prev(innerCode.end()));
+    innerCode.erase(firstJ, innerCode.end());
+    innerCode.insert(innerCode.end(), incI.begin(), incI.end());
+    innerCode.push_back((Instruction *)new GOTO(outerHead->label));
+    latchCode.clear();
+    latchCode.insert(latchCode.end(), incJ.begin(), incJ.end());
+    latchCode.push_back((Instruction *)new GOTO(innerHead->label));
+
+    std::vector<BasicBlock *> body(blocks.begin() + h1 + 3, blocks.begin() + l1);
+    std::vector<BasicBlock *> nest{initJ, innerHead, initIBlock, outerHead};
+    nest.insert(nest.end(), body.begin(), body.end());
+    nest.push_back(outerLatch);
+    delete pre;
+    blocks.erase(blocks.begin() + h1, blocks.begin() + l1 + 1);
+    blocks.insert(blocks.begin() + h1, nest.begin(), nest.end());
+    done.insert(innerHead->label);
+    done.insert(outerHead->label);
+    return true;
+}
@@ -0,0 +1,550 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+bool Optimizer::unrollLoops(FunctionBody &fn) {
+    // 每遍展开互不相邻的循环后重建基本块，内层循环展开后外层循环留到下一遍
+    std::set<std::string> done;
+    bool changed = false;
+    while (sweepLoops(fn, findLoops(fn), [&](Loop &loop) {
+        if (done.count(loop.header->label))
+            return false;
+        done.insert(loop.header->label);
+        return unrollLoop(fn, loop, done);
+    }))
+        changed = true;
+    return changed;
+}
+
+bool Optimizer::matchCountedLoop(FunctionBody &fn, Loop &loop, CountedLoop &info) {
+    /*
+     * 只处理 while 生成的计数循环：
+     * H:
+     *   [由循环不变量计算界的临时变量]
+     *   if i !op n GOTO exit
+     *   body ...
+     *   i = i + c
+     *   GOTO H
+     * exit:
+     * 循环体的块在代码中连续，除了header的测试之外没有离开循环的跳转，也没有内层循环
+     */
+    auto &blocks = fn.blocks;
+    BasicBlock * header = loop.header;
+    BasicBlock * latch = loop.latch;
+    if (latch == nullptr || header->label.empty())
+        return false;
+    int h = header->index, l = latch->index;
+    if (l <= h || (int)loop.blocks.size() != l - h + 1 || l + 1 >= (int)blocks.size())
+        return false;
+    for (int i = h; i <= l; i++)
+        if (!loop.blocks.count(blocks[i]))
+            return false;
+    Instruction * test = header->code.empty() ? nullptr : header->code.back();
+    if (test == nullptr || test->getType() != InstructionType::CMP_ || branchLabel(test) != blocks[l + 1]->label)
+        return false;
+    if (latch->code.empty() || latch->code.back()->getType() != InstructionType::GOTO_)
+        return false;
+    for (int i = h + 1; i <= l; i++)
+        for (auto succ : blocks[i]->succs)
+            if (!loop.blocks.count(succ) || (succ->index <= i && !(i == l && succ == header)))
+                return false;
+
+    // 循环中出现的临时变量不能在循环外使用；统计各变量在循环中的定值
+    std::map<Var *, int> &defs = info.defs;
+    std::set<Var *> loopTemps;
+    bool hasCall = false;
+    int bodySize = 0;
+    defs.clear();
+    for (int i = h; i <= l; i++)
+        for (auto ins : blocks[i]->code) {
+            for (auto slot : useSlots(ins))
+                if ((*slot)->type == VarType::TempVar)
+                    loopTemps.insert(*slot);
+            if (Var * d = defOf(ins)) {
+                defs[d]++;
+                if (d->type == VarType::TempVar)
+                    loopTemps.insert(d);
+            }
+            if (ins->getType() == InstructionType::Call_)
+                hasCall = true;
+            if (i > h)
+                bodySize++;
+        }
+    bodySize--;
+    for (int i = 0; i < (int)blocks.size(); i++) {
+        if (i >= h && i <= l)
+            continue;
+        for (auto ins : blocks[i]->code) {
+            for (auto slot : useSlots(ins))
+                if (loopTemps.count(*slot))
+                    return false;
+            if (defOf(ins) != nullptr && loopTemps.count(defOf(ins)))
+                return false;
+        }
+    }
+    auto definedInLoop = [&defs](Var * var) {
+        for (auto &[v, n] : defs)
+            if (sameVar(v, var))
+                return true;
+        return false;
+    };
+
+    // 找出归纳变量 i 和步长：i 在循环中只在latch里以 i = i ± c 定值一次
+    Var * iv = nullptr;
+    int64_t step = 0;
+    Instruction * inc = nullptr, * ivDef = nullptr;
+    TokenType cont = invertRelation(((CMP *)test)->opType);
+    Var * bound = nullptr;
+    for (int side = 0; side < 2 && iv == nullptr; side++) {
+        Var * cand = side == 0 ? test->src_1 : test->src_2;
+        if (!isScalarLocal(cand))
+            continue;
+        int count = 0;
+        Instruction * def = nullptr;
+        for (int i = h; i <= l; i++)
+            for (auto ins : blocks[i]->code)
+                if (defOf(ins) != nullptr && sameVar(defOf(ins), cand)) {
+                    count++;
+                    def = ins;
+                }
+        if (count != 1)
+            continue;
+        auto pos = std::find(latch->code.begin(), latch->code.end(), def);
+        if (pos == latch->code.end())
+            continue;
+        inc = def;
+        if (def->getType() == InstructionType::Assign_ && def->src_1->type == VarType::TempVar &&
+            pos != latch->code.begin()) {
+            inc = *std::prev(pos);
+            if (defOf(inc) != def->src_1 || defs[def->src_1] != 1)
+                continue;
+        }
+        if (inc->getType() != InstructionType::Binary_op_)
+            continue;
+        auto op = ((Binary_op *)inc)->code;
+        if (op == Binary_op::Add && sameVar(inc->src_1, cand) && inc->src_2->type == VarType::ConstVar)
+            step = inc->src_2->value;
+        else if (op == Binary_op::Add && sameVar(inc->src_2, cand) && inc->src_1->type == VarType::ConstVar)
+            step = inc->src_1->value;
+        else if (op == Binary_op::Sub && sameVar(inc->src_1, cand) && inc->src_2->type == VarType::ConstVar)
+            step = -inc->src_2->value;
+        else
+            continue;
+        iv = cand;
+        ivDef = def;
+        bound = side == 0 ? test->src_2 : test->src_1;
+        if (side == 1)
+            cont = swapRelation(cont);
+    }
+    if (iv == nullptr || step == 0)
+        return false;
+    if (!((step > 0 && (cont == TokenType::op_less || cont == TokenType::op_lesseq)) ||
+          (step < 0 && (cont == TokenType::op_greater || cont == TokenType::op_greatereq))))
+        return false;
+
+    // 界以及header中计算界的指令只能依赖循环不变量
+    auto invariant = [&](Var * var) {
+        switch (var->type) {
+            case VarType::ConstVar:
+                return true;
+            case VarType::TempVar:
+                return true;
+            case VarType::LocalVar:
+                return !var->isArray && !sameVar(var, iv) && !definedInLoop(var);
+            case VarType::GlobalVar:
+                return !var->isArray && !hasCall && !definedInLoop(var);
+            default:
+                return false;
+        }
+    };
+    for (auto ins : header->code) {
+        if (ins == test)
+            continue;
+        auto type = ins->getType();
+        if ((type != InstructionType::Binary_op_ && type != InstructionType::Assign_) ||
+            defOf(ins)->type != VarType::TempVar)
+            return false;
+        for (auto slot : useSlots(ins))
+            if (!invariant(*slot))
+                return false;
+    }
+    if (!invariant(bound))
+        return false;
+    if (bound->type == VarType::TempVar) {
+        bool inHeader = false;
+        for (auto ins : header->code)
+            if (defOf(ins) == bound)
+                inHeader = true;
+        if (!inHeader)
+            return false;
+    }
+
+    info.h = h;
+    info.l = l;
+    info.test = test;
+    info.iv = iv;
+    info.step = step;
+    info.cont = cont;
+    info.bound = bound;
+    info.inc = inc;
+    info.ivDef = ivDef;
+    info.bodySize = bodySize;
+    info.hasCall = hasCall;
+    return true;
+}
+
+std::vector<Reduction> Optimizer::matchReductions(FunctionBody &fn, CountedLoop &info) {
+    /*
+     * 循环中对 s 的读写只有同一块中的
+     *   t = s op x
+     *   s = t
+     * 各次迭代的x都不依赖s。int的 + 和 * 按2^32取模，满足交换律和结合律，
+     * 所以可以把x分给几个部分和分别累加，循环结束后再合并，结果和原来的顺序相同
+     */
+    std::vector<Reduction> reductions;
+    auto &blocks = fn.blocks;
+    auto count = [&](Var * var, bool use) {
+        int n = 0;
+        for (int i = info.h; i <= info.l; i++)
+            for (auto ins : blocks[i]->code) {
+                if (!use && defOf(ins) != nullptr && sameVar(defOf(ins), var))
+                    n++;
+                if (use)
+                    for (auto slot : useSlots(ins))
+                        if (sameVar(*slot, var))
+                            n++;
+            }
+        return n;
+    };
+    for (int i = info.h + 1; i <= info.l; i++) {
+        auto &code = blocks[i]->code;
+        for (auto it = code.begin(); it != code.end(); it++) {
+            Instruction * def = *it;
+            Var * s = defOf(def);
+            if (s == nullptr || !isScalarLocal(s) || sameVar(s, info.iv) || def->getType() == InstructionType::Call_)
+                continue;
+            Instruction * update = def;
+            if (def->getType() == InstructionType::Assign_) {
+                Var * t = def->src_1;
+                if (t->type != VarType::TempVar || it == code.begin() || defOf(*std::prev(it)) != t ||
+                    count(t, false) != 1 || count(t, true) != 1)
+                    continue;
+                update = *std::prev(it);
+            }
+            if (update->getType() != InstructionType::Binary_op_ || count(s, false) != 1 || count(s, true) != 1)
+                continue;
+            auto op = ((Binary_op *)update)->code;
+            bool left = sameVar(update->src_1, s), right = sameVar(update->src_2, s);
+            if (((op == Binary_op::Add || op == Binary_op::Mul) && (left || right)) || (op == Binary_op::Sub && left))
+                reductions.push_back({s, op, update, def});
+        }
+    }
+    return reductions;
+}
+
+bool Optimizer::unrollLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done) {
+    CountedLoop info;
+    if (!matchCountedLoop(fn, loop, info))
+        return false;
+    auto &blocks = fn.blocks;
+    BasicBlock * header = loop.header;
+    BasicBlock * latch = loop.latch;
+    int h = info.h, l = info.l;
+    Instruction * test = info.test;
+    Var * iv = info.iv;
+    int64_t step = info.step;
+    TokenType cont = info.cont;
+    Var * bound = info.bound;
+    int bodySize = info.bodySize;
+    std::vector<BasicBlock *> body(blocks.begin() + h + 1, blocks.begin() + l + 1);
+
+    // 初值和界都是常量、迭代次数少的循环完全展开
+    bool singleEntry = h > 0;
+    for (auto pred : header->preds)
+        if (pred != latch && pred->index != h - 1)
+            singleEntry = false;
+    if (singleEntry && bound->type == VarType::ConstVar) {
+        // 沿着唯一前驱向上找 i 的最后一次定值
+        bool known = false;
+        int64_t init = 0;
+        BasicBlock * b = blocks[h - 1];
+        for (int depth = 0; depth < 16 && b != nullptr; depth++) {
+            Instruction * last = nullptr;
+            for (auto ins : b->code)
+                if (defOf(ins) != nullptr && sameVar(defOf(ins), iv))
+                    last = ins;
+            if (last != nullptr) {
+                if (last->getType() == InstructionType::Assign_ && last->src_1->type == VarType::ConstVar) {
+                    known = true;
+                    init = last->src_1->value;
+                }
+                break;
+            }
+            b = b->preds.size() == 1 && b->preds[0]->index < b->index ? b->preds[0] : nullptr;
+        }
+        // 按32位补码推进 i，越过int边界回绕时和目标机器上的迭代次数一致
+        auto advance = [step](int64_t v) {
+            return (int64_t)(int32_t)(uint32_t)(v + step);
+        };
+        int trip = 0;
+        for (int64_t v = init; known && trip <= fullUnrollMaxTrip && evalRelation(cont, v, bound->value); v = advance(v))
+            trip++;
+        if (known && trip <= fullUnrollMaxTrip && trip * bodySize <= fullUnrollMaxSize) {
+            std::vector<BasicBlock *> unrolled;
+            int64_t v = init;
+            for (int j = 0; j < trip; j++, v = advance(v)) {
+                auto copy = cloneBlocks(body);
+                copy.back()->code.pop_back();
+                foldInductionCopy(copy, iv, v);
+                unrolled.insert(unrolled.end(), copy.begin(), copy.end());
+            }
+            for (int i = h; i <= l; i++)
+                delete blocks[i];
+            blocks.erase(blocks.begin() + h, blocks.begin() + l + 1);
+            blocks.insert(blocks.begin() + h, unrolled.begin(), unrolled.end());
+            return true;
+        }
+    }
+
+    // 其余的部分展开：先判断还剩至少unrollFactor次迭代，执行unrollFactor份循环体，
+    // 剩下不足unrollFactor次的迭代交给原来的循环。
+    // 判断写成 i cont n - span 而不是 i + span cont n，i + span 在int边界附近会回绕
+    if (bodySize > unrollMaxBody)
+        return false;
+    int64_t span = step * (unrollFactor - 1);
+    if (bound->type == VarType::ConstVar && (bound->value - span < INT32_MIN || bound->value - span > INT32_MAX))
+        return false;
+    std::string unrolledLabel = gen.newLabel();
+    auto guard = new BasicBlock();
+    guard->label = unrolledLabel;
+    // 界不是常量时先在循环前检查 n - span 不回绕，否则只执行原来的循环
+    BasicBlock * check = nullptr;
+    if (bound->type != VarType::ConstVar) {
+        check = new BasicBlock();
+        std::map<Var *, Var *> temps;
+        std::map<std::string, std::string> labels;
+        for (auto ins : header->code)
+            if (ins != test)
+                check->code.push_back(cloneInstruction(ins, temps, labels));
+        Var * n = temps.count(bound) ? temps[bound] : bound;
+        if (span > 0)
+            check->code.push_back((Instruction *)new CMP(TokenType::op_less, n, gen.getConstVar((int64_t)INT32_MIN + span),
+                                                         header->label));
+        else
+            check->code.push_back((Instruction *)new CMP(TokenType::op_greater, n,
+                                                         gen.getConstVar((int64_t)INT32_MAX + span), header->label));
+    }
+    std::map<Var *, Var *> temps;
+    std::map<std::string, std::string> labels;
+    for (auto ins : header->code) {
+        auto copy = cloneInstruction(ins, temps, labels);
+        if (ins == test) {
+            Var * n = temps.count(bound) ? temps[bound] : bound, * last;
+            if (n->type == VarType::ConstVar)
+                last = gen.getConstVar(n->value - span);
+            else {
+                last = gen.newTempVar();
+                if (span > 0)
+                    guard->code.push_back((Instruction *)new Binary_op(Binary_op::Sub, n, gen.getConstVar(span), last));
+                else
+                    guard->code.push_back((Instruction *)new Binary_op(Binary_op::Add, n, gen.getConstVar(-span), last));
+            }
+            for (auto slot : useSlots(copy))
+                if (sameVar(*slot, n))
+                    *slot = last;
+            branchLabel(copy) = header->label;
+        }
+        guard->code.push_back(copy);
+    }
+    // 乘法的归约变量在相邻的几份循环体中轮流累乘到不同的部分积，打断迭代之间的依赖链；
+    // 部分积在进入展开的循环前置为1，离开时合并回原变量，再交给原来的循环。
+    // 加减的结果下一条指令就能用，拆开只会多占寄存器，留给向量化按lane拆分
+    std::vector<Reduction> reductions;
+    for (auto &r : matchReductions(fn, info))
+        if (r.op == Binary_op::Mul)
+            reductions.push_back(r);
+    std::vector<std::vector<Var *>> partials;
+    auto init = new BasicBlock();
+    auto merge = new BasicBlock();
+    for (auto &r : reductions) {
+        std::vector<Var *> acc{r.var};
+        for (int k = 1; k < reductionAccumulators; k++) {
+            acc.push_back(newLocal(fn, r.var, ctx->symbols[r.var->getName()]->accessWeight));
+            init->code.push_back((Instruction *)new Assign(gen.getConstVar(1), acc[k]));
+            Var * t = gen.newTempVar();
+            merge->code.push_back((Instruction *)new Binary_op(Binary_op::Mul, r.var, acc[k], t));
+            merge->code.push_back((Instruction *)new Assign(t, r.var));
+        }
+        partials.push_back(acc);
+    }
+    if (!reductions.empty()) {
+        merge->label = gen.newLabel();
+        branchLabel(guard->code.back()) = merge->label;
+    }
+    std::vector<BasicBlock *> unrolled{guard};
+    for (int j = 0; j < unrollFactor; j++) {
+        auto copy = cloneBlocks(body);
+        copy.back()->code.pop_back();
+        for (std::size_t r = 0; r < reductions.size() && j % reductionAccumulators != 0; r++)
+            for (auto block : copy)
+                for (auto ins : block->code) {
+                    for (auto slot : useSlots(ins))
+                        if (sameVar(*slot, reductions[r].var))
+                            *slot = partials[r][j % reductionAccumulators];
+                    if (defSlot(ins) != nullptr && sameVar(*defSlot(ins), reductions[r].var))
+                        *defSlot(ins) = partials[r][j % reductionAccumulators];
+                }
+        unrolled.insert(unrolled.end(), copy.begin(), copy.end());
+    }
+    unrolled.back()->code.push_back((Instruction *)new GOTO(unrolledLabel));
+    if (!reductions.empty()) {
+        unrolled.insert(unrolled.begin(), init);
+        unrolled.push_back(merge);
+    } else {
+        delete init;
+        delete merge;
+    }
+    if (check != nullptr)
+        unrolled.insert(unrolled.begin(), check);
+    blocks.insert(blocks.begin() + h, unrolled.begin(), unrolled.end());
+    done.insert(unrolledLabel);
+    return true;
+}
+
+void Optimizer::foldInductionCopy(std::vector<BasicBlock *> &copy, Var * iv, int64_t value) {
+    // 代入 i 的值，两个操作数都是常量的运算折叠成赋值；
+    // 只定值一次的临时变量得到常量后直接代入它的使用，赋值本身删去
+    std::map<Var *, int> defs;
+    for (auto block : copy)
+        for (auto ins : block->code)
+            if (defOf(ins) != nullptr)
+                defs[defOf(ins)]++;
+    std::map<Var *, int64_t> known;
+    for (auto block : copy)
+        for (auto it = block->code.begin(); it != block->code.end();) {
+            Instruction * ins = *it;
+            for (auto slot : useSlots(ins)) {
+                if (sameVar(*slot, iv))
+                    *slot = gen.getConstVar(value);
+                else if (known.count(*slot))
+                    *slot = gen.getConstVar(known[*slot]);
+            }
+            int64_t result;
+            if (ins->getType() == InstructionType::Binary_op_ && ins->src_1->type == VarType::ConstVar &&
+                ins->src_2->type == VarType::ConstVar &&
+                foldBinary(((Binary_op *)ins)->code, ins->src_1->value, ins->src_2->value, result)) {
+                ins = (Instruction *)new Assign(gen.getConstVar(result), ins->dst);
+                *it = ins;
+            }
+            Var * d = defOf(ins);
+            bool isConst = ins->getType() == InstructionType::Assign_ && ins->src_1->type == VarType::ConstVar;
+            if (d != nullptr && sameVar(d, iv) && isConst)
+                value = ins->src_1->value;
+            if (d != nullptr && d->type == VarType::TempVar && isConst && defs[d] == 1) {
+                known[d] = ins->src_1->value;
+                it = block->code.erase(it);
+                continue;
+            }
+            it++;
+        }
+}
+
+bool Optimizer::rotateLoops(FunctionBody &fn) {
+    std::set<std::string> done;
+    bool changed = false;
+    while (sweepLoops(fn, findLoops(fn), [&](Loop &loop) {
+        if (done.count(loop.header->label))
+            return false;
+        done.insert(loop.header->label);
+        return rotateLoop(fn, loop, done);
+    }))
+        changed = true;
+    return changed;
+}
+
+bool Optimizer::rotateLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done) {
+    /*
+     * H:                            [H的副本] if !cond GOTO exit
+     *   ...                       B:
+     *   if !cond GOTO exit          body ...
+     * B:                   ==>    H:
+     *   body ...                    ...
+     *   GOTO H                      if cond GOTO B
+     * exit:                       exit:
+     * 循环前的副本判断是否一次也不执行，之后每次迭代只在底部执行一次条件跳转。
+     * 副本沿用标号H，从循环外跳到H的代码仍然先做判断；continue 改为跳到底部的测试
+     */
+    auto &blocks = fn.blocks;
+    BasicBlock * header = loop.header;
+    int h = header->index, l = h;
+    for (auto block : loop.blocks)
+        l = std::max(l, block->index);
+    if (header->label.empty() || l == h || (int)loop.blocks.size() != l - h + 1)
+        return false;
+    for (int i = h; i <= l; i++)
+        if (!loop.blocks.count(blocks[i]))
+            return false;
+    BasicBlock * latch = blocks[l];
+    if (latch->code.empty() || latch->code.back()->getType() != InstructionType::GOTO_ ||
+        branchLabel(latch->code.back()) != header->label)
+        return false;
+    Instruction * test = header->code.empty() ? nullptr : header->code.back();
+    if (test == nullptr || (test->getType() != InstructionType::CMP_ && test->getType() != InstructionType::IfZ_))
+        return false;
+    BasicBlock * exit = fn.labels.at(branchLabel(test));
+    if (loop.blocks.count(exit))
+        return false;
+    // header中定值的临时变量只在header中使用
+    std::set<Var *> headerTemps;
+    for (auto ins : header->code)
+        if (defOf(ins) != nullptr && defOf(ins)->type == VarType::TempVar)
+            headerTemps.insert(defOf(ins));
+    for (auto block : blocks) {
+        if (block == header)
+            continue;
+        for (auto ins : block->code) {
+            for (auto slot : useSlots(ins))
+                if (headerTemps.count(*slot))
+                    return false;
+            if (defOf(ins) != nullptr && headerTemps.count(defOf(ins)))
+                return false;
+        }
+    }
+
+    BasicBlock * top = blocks[h + 1];
+    if (top->label.empty())
+        top->label = gen.newLabel();
+    auto guard = new BasicBlock();
+    guard->label = header->label;
+    header->label = "";
+    for (int i = h + 1; i < l; i++) {
+        Instruction * last = blocks[i]->code.empty() ? nullptr : blocks[i]->code.back();
+        if (last == nullptr || !isBranch(last) || branchLabel(last) != guard->label)
+            continue;
+        if (header->label.empty())
+            header->label = gen.newLabel();
+        branchLabel(last) = header->label;
+    }
+    std::map<Var *, Var *> temps;
+    std::map<std::string, std::string> labels;
+    for (auto ins : header->code)
+        guard->code.push_back(cloneInstruction(ins, temps, labels));
+    // 底部的测试：条件成立时回到循环体开头，否则落入或跳到出口
+    Instruction * bottom;
+    if (test->getType() == InstructionType::CMP_)
+        bottom = (Instruction *)new CMP(invertRelation(((CMP *)test)->opType), test->src_1, test->src_2, top->label);
+    else
+        bottom = (Instruction *)new CMP(TokenType::op_exclaimeq, test->src_1, gen.getConstVar(0), top->label);
+    header->code.back() = bottom;
+    if (l + 1 >= (int)blocks.size() || blocks[l + 1] != exit)
+        header->code.push_back((Instruction *)new GOTO(exit->label));
+    latch->code.pop_back();
+    blocks.erase(blocks.begin() + h);
+    blocks.insert(blocks.begin() + l, header);
+    blocks.insert(blocks.begin() + h, guard);
+    done.insert(top->label);
+    return true;
+}
@@ -0,0 +1,440 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+#include <functional>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+Optimizer::Optimizer(CodeGenerator &generator, const std::shared_ptr<Context> &context) : gen(generator) {
+    ctx = context;
+}
+
+void Optimizer::optimize() {
+    collectPureFunctions();
+    std::string curFunc;
+    auto p = gen.code.begin();
+    while (p != gen.code.end()) {
+        if ((*p)->getType() == InstructionType::Label_ && ((Label *)(*p))->label[0] != '.')
+            curFunc = ((Label *)(*p))->label;
+        if ((*p)->getType() != InstructionType::BeginFunc_) {
+            p++;
+            continue;
+        }
+        // 取出BeginFunc和EndFunc之间的指令单独优化，再放回原处
+        auto first = std::next(p);
+        auto last = first;
+        while ((*last)->getType() != InstructionType::EndFunc_)
+            last++;
+        std::list<Instruction *> code;
+        code.splice(code.begin(), gen.code, first, last);
+        fuseCompareBranches(code);
+        FunctionBody fn;
+        fn.name = curFunc;
+        buildBlocks(fn, code);
+        buildCFG(fn);
+        combineInstructions(fn);
+        evaluateCalls(fn);
+        propagateCopies(fn);
+        simplifyWithRanges(fn);
+        eliminateDeadCode(fn);
+        interchangeLoops(fn);
+        unswitchLoops(fn);
+        promoteLoops(fn);
+        if (ctx->neon)
+            vectorizeLoops(fn);
+        unrollLoops(fn);
+        rotateLoops(fn);
+        combineInstructions(fn);
+        evaluateCalls(fn);
+        eliminatePartialRedundancy(fn);
+        propagateCopies(fn);
+        threadJumps(fn);
+        eliminateDeadCode(fn);
+        // 循环的各趟依赖循环前的空块作为前置块，合并和穿过空块放到最后做
+        simplifyCFG(fn);
+        code = linearize(fn);
+        for (auto block : fn.blocks)
+            delete block;
+        gen.code.splice(last, code);
+        p = last;
+    }
+}
+
+void Optimizer::buildBlocks(FunctionBody &fn, std::list<Instruction *> &code) {
+    fn.blocks.clear();
+    BasicBlock * cur = nullptr;
+    auto newBlock = [&fn](const std::string &label) {
+        auto block = new BasicBlock();
+        block->label = label;
+        fn.blocks.push_back(block);
+        return block;
+    };
+    for (auto ins : code) {
+        if (ins->getType() == InstructionType::Label_) {
+            cur = newBlock(((Label *)ins)->label);
+            continue;
+        }
+        if (cur == nullptr)
+            cur = newBlock("");
+        cur->code.push_back(ins);
+        if (isBranch(ins))
+            cur = nullptr;
+    }
+}
+
+void Optimizer::buildCFG(FunctionBody &fn) {
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    fn.labels.clear();
+    for (int i = 0; i < n; i++) {
+        blocks[i]->index = i;
+        blocks[i]->succs.clear();
+        blocks[i]->preds.clear();
+        if (!blocks[i]->label.empty())
+            fn.labels[blocks[i]->label] = blocks[i];
+    }
+    for (int i = 0; i < n; i++) {
+        Instruction * last = blocks[i]->code.empty() ? nullptr : blocks[i]->code.back();
+        if (last != nullptr && isBranch(last))
+            blocks[i]->succs.push_back(fn.labels.at(branchLabel(last)));
+        if ((last == nullptr || last->getType() != InstructionType::GOTO_) && i + 1 < n &&
+            (blocks[i]->succs.empty() || blocks[i]->succs[0] != blocks[i + 1]))
+            blocks[i]->succs.push_back(blocks[i + 1]);
+        for (auto succ : blocks[i]->succs)
+            succ->preds.push_back(blocks[i]);
+    }
+    // 从入口块可达的块
+    fn.reachable.assign(n, false);
+    std::vector<BasicBlock *> work;
+    if (n != 0) {
+        fn.reachable[0] = true;
+        work.push_back(blocks[0]);
+    }
+    while (!work.empty()) {
+        auto block = work.back();
+        work.pop_back();
+        for (auto succ : block->succs)
+            if (!fn.reachable[succ->index]) {
+                fn.reachable[succ->index] = true;
+                work.push_back(succ);
+            }
+    }
+    // Cooper-Harvey-Kennedy：按逆后序迭代求直接支配者，两个支配者沿支配树向上走到公共祖先
+    fn.idom.assign(n, -1);
+    if (n == 0)
+        return;
+    std::vector<int> order(n, -1), rpo;
+    std::vector<std::pair<BasicBlock *, std::size_t>> stack{{blocks[0], 0}};
+    order[0] = 0;
+    while (!stack.empty()) {
+        auto &[block, next] = stack.back();
+        if (next < block->succs.size()) {
+            BasicBlock * succ = block->succs[next++];
+            if (order[succ->index] == -1) {
+                order[succ->index] = 0;
+                stack.emplace_back(succ, 0);
+            }
+            continue;
+        }
+        rpo.push_back(block->index);
+        stack.pop_back();
+    }
+    std::reverse(rpo.begin(), rpo.end());
+    for (std::size_t i = 0; i < rpo.size(); i++)
+        order[rpo[i]] = i;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (order[a] > order[b])
+                a = fn.idom[a];
+            while (order[b] > order[a])
+                b = fn.idom[b];
+        }
+        return a;
+    };
+    fn.idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::size_t i = 1; i < rpo.size(); i++) {
+            int b = rpo[i], d = -1;
+            for (auto pred : blocks[b]->preds) {
+                int p = pred->index;
+                if (fn.idom[p] == -1)
+                    continue;
+                d = d == -1 ? p : intersect(p, d);
+            }
+            if (d != fn.idom[b]) {
+                fn.idom[b] = d;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool Optimizer::dominates(FunctionBody &fn, BasicBlock * d, BasicBlock * b) {
+    int i = b->index;
+    if (fn.idom[i] == -1)
+        return false;
+    while (i != d->index && i != 0)
+        i = fn.idom[i];
+    return i == d->index;
+}
+
+std::list<Instruction *> Optimizer::linearize(FunctionBody &fn) {
+    std::list<Instruction *> code;
+    for (auto block : fn.blocks) {
+        if (!block->label.empty()) {
+            std::string label = block->label;
+            code.push_back((Instruction *)new Label(label));
+        }
+        code.insert(code.end(), block->code.begin(), block->code.end());
+    }
+    return code;
+}
+
+void Optimizer::rebuild(FunctionBody &fn) {
+    auto code = linearize(fn);
+    for (auto block : fn.blocks)
+        delete block;
+    buildBlocks(fn, code);
+    buildCFG(fn);
+}
+
+std::vector<Loop> Optimizer::findLoops(FunctionBody &fn) {
+    // 支配者是自己后继的边是回边，同一个header的回边合成一个循环
+    std::map<BasicBlock *, Loop> loops;
+    for (auto block : fn.blocks) {
+        if (!fn.reachable[block->index])
+            continue;
+        for (auto header : block->succs) {
+            if (!dominates(fn, header, block))
+                continue;
+            auto it = loops.find(header);
+            if (it == loops.end())
+                it = loops.emplace(header, Loop{header, block, {header}}).first;
+            else
+                it->second.latch = nullptr;
+            // 从回边的尾逆着前驱找到header为止
+            std::vector<BasicBlock *> work{block};
+            while (!work.empty()) {
+                auto b = work.back();
+                work.pop_back();
+                if (!it->second.blocks.insert(b).second)
+                    continue;
+                for (auto pred : b->preds)
+                    if (fn.reachable[pred->index])
+                        work.push_back(pred);
+            }
+        }
+    }
+    std::vector<Loop> result;
+    for (auto &[header, loop] : loops)
+        result.push_back(loop);
+    // 块数相同时按代码顺序，结果不依赖块的地址
+    std::stable_sort(result.begin(), result.end(), [](const Loop &a, const Loop &b) {
+        if (a.blocks.size() != b.blocks.size())
+            return a.blocks.size() < b.blocks.size();
+        return a.header->index < b.header->index;
+    });
+    return result;
+}
+
+bool Optimizer::sweepLoops(FunctionBody &fn, std::vector<Loop> loops, const std::function<bool(Loop &)> &transform) {
+    /*
+     * 各趟只改动循环本身的块，新块插在循环所在的位置。按loops的顺序依次改写，
+     * 循环的块以及进出它的边连到的块都没有改写过时，前驱后继仍然有效，重新编号后可以接着改写；
+     * 与改写过的循环相交、相邻或包含它们的循环留到下一遍
+     */
+    std::set<BasicBlock *> touched;
+    bool changed = false;
+    for (auto &loop : loops) {
+        // 改写过的块可能已经删除，只比较指针
+        bool clear = true;
+        for (auto block : loop.blocks)
+            if (touched.count(block))
+                clear = false;
+        if (!clear)
+            continue;
+        for (auto block : loop.blocks)
+            for (auto edges : {&block->preds, &block->succs})
+                for (auto other : *edges)
+                    if (touched.count(other))
+                        clear = false;
+        if (!clear)
+            continue;
+        auto blocks = loop.blocks;
+        if (!transform(loop))
+            continue;
+        touched.insert(blocks.begin(), blocks.end());
+        for (int i = 0; i < (int)fn.blocks.size(); i++)
+            fn.blocks[i]->index = i;
+        changed = true;
+    }
+    if (changed)
+        rebuild(fn);
+    return changed;
+}
+
+void Optimizer::fuseCompareBranches(std::list<Instruction *> &code) {
+    /*
+     * 关系表达式和!作为条件时生成
+     *   if a op b GOTO L1        IfZ a GOTO L1
+     *   t = 0                    t = 0
+     *   GOTO L2                  GOTO L2
+     * L1:                      L1:
+     *   t = 1                    t = 1
+     * L2:                      L2:
+     *   IfZ t GOTO L3            IfZ t GOTO L3
+     * t只在这里出现、L1和L2没有别的跳转时，合并为 if a !op b GOTO L3 / if a != 0 GOTO L3
+     */
+    std::map<std::string, int> refs;
+    std::map<Var *, int> occurs;
+    for (auto ins : code) {
+        if (isBranch(ins))
+            refs[branchLabel(ins)]++;
+        for (auto slot : useSlots(ins))
+            occurs[*slot]++;
+        if (defOf(ins) != nullptr)
+            occurs[defOf(ins)]++;
+    }
+    auto isAssignConst = [](Instruction * ins, Var * dst, int64_t value) {
+        return ins->getType() == InstructionType::Assign_ && ins->src_2 == dst &&
+               ins->src_1->type == VarType::ConstVar && ins->src_1->value == value;
+    };
+    auto isLabel = [](Instruction * ins, const std::string &label) {
+        return ins->getType() == InstructionType::Label_ && ((Label *)ins)->label == label;
+    };
+    for (auto it = code.begin(); it != code.end(); it++) {
+        auto type = (*it)->getType();
+        if (type != InstructionType::CMP_ && type != InstructionType::IfZ_)
+            continue;
+        std::vector<std::list<Instruction *>::iterator> seq{it};
+        for (int i = 0; i < 6 && std::next(seq.back()) != code.end(); i++)
+            seq.push_back(std::next(seq.back()));
+        if (seq.size() != 7)
+            continue;
+        std::string l1 = branchLabel(*it);
+        Instruction * assign0 = *seq[1];
+        if (assign0->getType() != InstructionType::Assign_)
+            continue;
+        Var * t = assign0->src_2;
+        if (t->type != VarType::TempVar || occurs[t] != 3 || !isAssignConst(assign0, t, 0) ||
+            (*seq[2])->getType() != InstructionType::GOTO_ || !isLabel(*seq[3], l1) ||
+            !isAssignConst(*seq[4], t, 1) || !isLabel(*seq[5], branchLabel(*seq[2])) ||
+            (*seq[6])->getType() != InstructionType::IfZ_ || (*seq[6])->src_1 != t ||
+            refs[l1] != 1 || refs[branchLabel(*seq[2])] != 1)
+            continue;
+        std::string l3 = branchLabel(*seq[6]);
+        Instruction * fused;
+        if (type == InstructionType::CMP_)
+            fused = (Instruction *)new CMP(invertRelation(((CMP *)(*it))->opType), (*it)->src_1, (*it)->src_2, l3);
+        else
+            fused = (Instruction *)new CMP(TokenType::op_exclaimeq, (*it)->src_1, gen.getConstVar(0), l3);
+        *it = fused;
+        code.erase(seq[1], std::next(seq[6]));
+    }
+}
+
+Instruction * Optimizer::cloneInstruction(Instruction * ins, std::map<Var *, Var *> &temps,
+                                          std::map<std::string, std::string> &labels) {
+    auto var = [&](Var * v) {
+        if (v == nullptr || v->type != VarType::TempVar)
+            return v;
+        auto it = temps.find(v);
+        if (it != temps.end())
+            return it->second;
+        Var * t = gen.newTempVar();
+        t->isArray = v->isArray;
+        t->isVector = v->isVector;
+        temps[v] = t;
+        return t;
+    };
+    auto label = [&](const std::string &l) {
+        auto it = labels.find(l);
+        return it == labels.end() ? l : it->second;
+    };
+    switch (ins->getType()) {
+        case InstructionType::Binary_op_:
+            return (Instruction *)new Binary_op(((Binary_op *)ins)->code, var(ins->src_1), var(ins->src_2), var(ins->dst));
+        case InstructionType::Assign_:
+            return (Instruction *)new Assign(var(ins->src_1), var(ins->src_2));
+        case InstructionType::Load_:
+            return (Instruction *)new Load(var(ins->src_1), var(ins->src_2), var(ins->dst));
+        case InstructionType::Store_:
+            return (Instruction *)new Store(var(ins->src_1), var(ins->src_2), var(ins->dst));
+        case InstructionType::Param_:
+            return (Instruction *)new Param(((Param *)ins)->funName, var(ins->src_1));
+        case InstructionType::Call_: {
+            std::string fun = ((Call *)ins)->funLabel;
+            if (ins->numVars == 1)
+                return (Instruction *)new Call(fun, ((Call *)ins)->n, var(ins->src_1));
+            return (Instruction *)new Call(fun, ((Call *)ins)->n);
+        }
+        case InstructionType::Return_:
+            return (Instruction *)new Return(ins->numVars == 1 ? var(ins->src_1) : nullptr);
+        case InstructionType::GOTO_: {
+            std::string l = label(((GOTO *)ins)->label);
+            return (Instruction *)new GOTO(l);
+        }
+        case InstructionType::IfZ_: {
+            std::string l = label(((IfZ *)ins)->trueLabel);
+            return (Instruction *)new IfZ(var(ins->src_1), l);
+        }
+        case InstructionType::CMP_: {
+            std::string l = label(((CMP *)ins)->label);
+            return (Instruction *)new CMP(((CMP *)ins)->opType, var(ins->src_1), var(ins->src_2), l);
+        }
+        case InstructionType::Vector_:
+            if (ins->numVars == 2)
+                return (Instruction *)new VectorOp(((VectorOp *)ins)->code, var(ins->src_1), var(ins->src_2));
+            return (Instruction *)new VectorOp(((VectorOp *)ins)->code, var(ins->src_1), var(ins->src_2), var(ins->dst));
+        default:
+            return ins;
+    }
+}
+
+std::vector<BasicBlock *> Optimizer::cloneBlocks(const std::vector<BasicBlock *> &blocks) {
+    std::map<Var *, Var *> temps;
+    std::map<std::string, std::string> labels;
+    for (auto block : blocks)
+        if (!block->label.empty())
+            labels[block->label] = gen.newLabel();
+    std::vector<BasicBlock *> copy;
+    for (auto block : blocks) {
+        auto b = new BasicBlock();
+        b->label = block->label.empty() ? "" : labels[block->label];
+        for (auto ins : block->code)
+            b->code.push_back(cloneInstruction(ins, temps, labels));
+        copy.push_back(b);
+    }
+    return copy;
+}
+
+Var * Optimizer::newLocal(FunctionBody &fn, Var * like, std::size_t weight) {
+    // 名字在like的名字中@或%之前加上编号，like是全局变量时再加上@函数名，是临时变量时没有符号，用pre加编号；
+    // 在栈帧顶部占一个新的槽，按weight参与局部变量寄存器的分配
+    auto &func = ctx->functions[fn.name];
+    std::string name = like->type == VarType::TempVar ? "pre" : like->getName();
+    std::size_t at = name.find_first_of("@%");
+    if (at == std::string::npos)
+        name += "." + std::to_string(++localCount) + "@" + fn.name;
+    else
+        name.insert(at, "." + std::to_string(++localCount));
+    auto def = std::make_shared<syntax::VarDefinition>();
+    def->varName = std::make_shared<syntax::Identifier>();
+    def->varName->mangledId = name;
+    if (like->type == VarType::TempVar)
+        def->varName->identifier = "pre";
+    else {
+        auto &origin = ctx->symbols[like->getName()];
+        def->varName->identifier = origin->varName->identifier;
+        def->type = origin->type;
+    }
+    def->offset = func->stackSize;
+    def->accessWeight = weight;
+    func->stackSize += 4;
+    func->locals.push_back(def);
+    ctx->symbols[name] = def;
+    return new Var(name);
+}
@@ -0,0 +1,375 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    typedef std::vector<bool> Bits;
+
+    // 运算的键：运算符和两个操作数的名字，加法和乘法的操作数按名字排序
+    std::string exprKey(Instruction * ins) {
+        auto op = ((Binary_op *)ins)->code;
+        std::string a = ins->src_1->getName(), b = ins->src_2->getName();
+        if ((op == Binary_op::Add || op == Binary_op::Mul) && b < a)
+            std::swap(a, b);
+        return std::to_string(op) + " " + a + " " + b;
+    }
+}
+
+bool Optimizer::eliminatePartialRedundancy(FunctionBody &fn) {
+    bool changed = eliminateLocalRedundancy(fn);
+    if (lazyCodeMotion(fn)) {
+        rebuild(fn);
+        changed = true;
+    }
+    return changed;
+}
+
+bool Optimizer::eliminateLocalRedundancy(FunctionBody &fn) {
+    // 块内前面算过、操作数和结果此后都没有被重新定值的运算，改为复制前面的结果
+    auto temps = collectTemps(fn);
+    bool changed = false;
+    for (auto block : fn.blocks) {
+        std::map<std::string, Instruction *> computed;
+        std::vector<std::list<Instruction *>::iterator> copies;
+        for (auto it = block->code.begin(); it != block->code.end(); it++) {
+            Instruction * ins = *it;
+            bool candidate = ins->getType() == InstructionType::Binary_op_ && !ins->dst->isVector;
+            if (candidate && computed.count(exprKey(ins))) {
+                *it = (Instruction *)new Assign(computed[exprKey(ins)]->dst, ins->dst);
+                copies.push_back(it);
+                changed = true;
+            }
+            Var * d = defOf(*it);
+            bool call = ins->getType() == InstructionType::Call_;
+            for (auto c = computed.begin(); c != computed.end();) {
+                bool killed = false;
+                for (Var * var : {c->second->src_1, c->second->src_2, c->second->dst})
+                    if ((d != nullptr && sameVar(var, d)) || (call && var->type == VarType::GlobalVar))
+                        killed = true;
+                c = killed ? computed.erase(c) : std::next(c);
+            }
+            if (candidate && *it == ins && !sameVar(ins->dst, ins->src_1) && !sameVar(ins->dst, ins->src_2))
+                computed[exprKey(ins)] = ins;
+        }
+        for (auto copy : copies)
+            forwardCopy(block, copy, temps);
+    }
+    return changed;
+}
+
+bool Optimizer::lazyCodeMotion(FunctionBody &fn) {
+    /*
+     * 惰性代码移动（Knoop-Rüthing-Steffen，按Drechsler-Stadel的边形式），运算的操作数都不是临时变量：
+     *   可用：AVIN = ∩AVOUT(前驱)，AVOUT = COMP ∪ (AVIN ∩ TRANSP)
+     *   预期：ANTOUT = ∩ANTIN(后继)，ANTIN = ANTLOC ∪ (ANTOUT ∩ TRANSP)
+     *   EARLIEST(p,s) = ANTIN(s) ∩ ¬AVOUT(p) ∩ (¬TRANSP(p) ∪ ¬ANTOUT(p))
+     *   LATER(p,s) = EARLIEST(p,s) ∪ (LATERIN(p) ∩ ¬ANTLOC(p))，LATERIN(s) = ∩LATER(前驱,s)
+     *   INSERT(p,s) = LATER(p,s) ∩ ¬LATERIN(s)，DELETE(b) = ANTLOC(b) ∩ ¬LATERIN(b)
+     * 结果放进一个新的局部变量h：插入处计算 h = a op b，删去的运算改为 t = h，
+     * 留下的块中最后一次计算之后 h = t，再把这些块内的复制传播掉。
+     * 按循环嵌套估计执行次数，删去的比插入的多才做
+     */
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    if (n == 0)
+        return false;
+
+    // 候选的运算：结果是临时变量，操作数是标量局部变量、全局变量、数组或者常量，不都是常量
+    std::map<std::string, int> ids;
+    std::vector<Instruction *> sample;
+    std::map<std::string, std::vector<int>> operandOf;
+    std::vector<int> globalExprs;
+    auto candidate = [](Instruction * ins) {
+        if (ins->getType() != InstructionType::Binary_op_ || ins->dst->type != VarType::TempVar ||
+            ins->dst->isVector)
+            return false;
+        for (Var * var : {ins->src_1, ins->src_2})
+            if (var->type == VarType::TempVar || var->isVector)
+                return false;
+        return ins->src_1->type != VarType::ConstVar || ins->src_2->type != VarType::ConstVar;
+    };
+    for (auto block : blocks)
+        for (auto ins : block->code) {
+            if (!candidate(ins) || ids.count(exprKey(ins)))
+                continue;
+            int e = ids.size();
+            ids[exprKey(ins)] = e;
+            sample.push_back(ins);
+            bool global = false;
+            for (Var * var : {ins->src_1, ins->src_2}) {
+                if (var->type == VarType::ConstVar || var->isArray)
+                    continue;
+                auto &list = operandOf[var->getName()];
+                if (list.empty() || list.back() != e)
+                    list.push_back(e);
+                global = global || var->type == VarType::GlobalVar;
+            }
+            if (global)
+                globalExprs.push_back(e);
+        }
+    int m = ids.size();
+    if (m == 0)
+        return false;
+
+    // 块的局部性质
+    std::vector<Bits> antloc(n, Bits(m, false)), comp(n, Bits(m, false)), transp(n, Bits(m, true));
+    for (int i = 0; i < n; i++)
+        for (auto ins : blocks[i]->code) {
+            if (candidate(ins)) {
+                int e = ids[exprKey(ins)];
+                if (transp[i][e])
+                    antloc[i][e] = true;
+                comp[i][e] = true;
+            }
+            std::vector<int> killed;
+            if (defOf(ins) != nullptr && operandOf.count(defOf(ins)->getName()))
+                killed = operandOf[defOf(ins)->getName()];
+            if (ins->getType() == InstructionType::Call_)
+                killed.insert(killed.end(), globalExprs.begin(), globalExprs.end());
+            for (int e : killed) {
+                transp[i][e] = false;
+                comp[i][e] = false;
+            }
+        }
+
+    // 交汇：没有前驱（后继）时为空集
+    auto meet = [m](const std::vector<Bits> &sets, const std::vector<int> &from) {
+        Bits r(m, !from.empty());
+        for (int j : from)
+            for (int e = 0; e < m; e++)
+                r[e] = r[e] && sets[j][e];
+        return r;
+    };
+    std::vector<std::vector<int>> preds(n), succs(n);
+    for (int i = 0; i < n; i++) {
+        if (!fn.reachable[i])
+            continue;
+        for (auto succ : blocks[i]->succs) {
+            succs[i].push_back(succ->index);
+            preds[succ->index].push_back(i);
+        }
+    }
+    std::vector<Bits> avout(n, Bits(m, true)), antin(n, Bits(m, true)), antout(n, Bits(m, false));
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = 0; i < n; i++) {
+            Bits in = i == 0 ? Bits(m, false) : meet(avout, preds[i]);
+            Bits out(m);
+            for (int e = 0; e < m; e++)
+                out[e] = comp[i][e] || (in[e] && transp[i][e]);
+            if (out != avout[i]) {
+                avout[i] = out;
+                progress = true;
+            }
+        }
+    }
+    progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = n - 1; i >= 0; i--) {
+            antout[i] = meet(antin, succs[i]);
+            Bits in(m);
+            for (int e = 0; e < m; e++)
+                in[e] = antloc[i][e] || (antout[i][e] && transp[i][e]);
+            if (in != antin[i]) {
+                antin[i] = in;
+                progress = true;
+            }
+        }
+    }
+
+    // 边(p,s)，p为-1表示函数入口到第一个块
+    std::vector<std::pair<int, int>> edges{{-1, 0}};
+    for (int i = 0; i < n; i++)
+        for (int s : succs[i])
+            edges.emplace_back(i, s);
+    std::vector<Bits> earliest(edges.size()), later(edges.size());
+    std::vector<std::vector<int>> inEdges(n);
+    for (std::size_t k = 0; k < edges.size(); k++) {
+        auto [p, s] = edges[k];
+        inEdges[s].push_back(k);
+        earliest[k] = antin[s];
+        if (p >= 0)
+            for (int e = 0; e < m; e++)
+                earliest[k][e] = earliest[k][e] && !avout[p][e] && (!transp[p][e] || !antout[p][e]);
+    }
+    std::vector<Bits> laterin(n, Bits(m, true));
+    progress = true;
+    while (progress) {
+        progress = false;
+        for (std::size_t k = 0; k < edges.size(); k++) {
+            auto [p, s] = edges[k];
+            later[k] = earliest[k];
+            if (p >= 0)
+                for (int e = 0; e < m; e++)
+                    later[k][e] = later[k][e] || (laterin[p][e] && !antloc[p][e]);
+        }
+        for (int i = 0; i < n; i++) {
+            if (!fn.reachable[i])
+                continue;
+            Bits in(m, true);
+            for (int k : inEdges[i])
+                for (int e = 0; e < m; e++)
+                    in[e] = in[e] && later[k][e];
+            if (in != laterin[i]) {
+                laterin[i] = in;
+                progress = true;
+            }
+        }
+    }
+
+    // 插入的位置：p只有一个后继时放在p的末尾，s只有一个前驱时放在s的开头，否则拆分这条边；
+    // 拆分跳转边的新块放在某个以GOTO结尾的块之后，没有这样的位置时不能拆分
+    int splitAt = -1;
+    for (int i = n - 1; i >= 0 && splitAt < 0; i--)
+        if (!blocks[i]->code.empty() && blocks[i]->code.back()->getType() == InstructionType::GOTO_)
+            splitAt = i + 1;
+    std::vector<std::size_t> weight(n, 1);
+    for (auto &loop : findLoops(fn))
+        for (auto block : loop.blocks)
+            weight[block->index] = std::min<std::size_t>(weight[block->index] << 3, std::size_t(1) << 30);
+    enum Place { AtEnd, AtStart, SplitFall, SplitJump, NewEntry };
+    std::vector<Place> place(edges.size());
+    for (std::size_t k = 0; k < edges.size(); k++) {
+        auto [p, s] = edges[k];
+        if (p < 0)
+            place[k] = preds[0].empty() ? AtStart : NewEntry;
+        else if (succs[p].size() == 1)
+            place[k] = AtEnd;
+        else if (preds[s].size() == 1)
+            place[k] = AtStart;
+        else
+            place[k] = s == p + 1 ? SplitFall : SplitJump;
+    }
+    std::vector<int> chosen;
+    for (int e = 0; e < m; e++) {
+        std::size_t saved = 0, cost = 0;
+        bool placeable = true;
+        for (int i = 0; i < n; i++)
+            if (fn.reachable[i] && antloc[i][e] && !laterin[i][e])
+                saved += weight[i];
+        for (std::size_t k = 0; k < edges.size(); k++) {
+            auto [p, s] = edges[k];
+            if (!later[k][e] || laterin[s][e])
+                continue;
+            cost += p < 0 ? weight[s] : std::min(weight[p], weight[s]);
+            if (place[k] == SplitJump && splitAt < 0)
+                placeable = false;
+        }
+        if (placeable && saved > 8 * cost)
+            chosen.push_back(e);
+    }
+    if (chosen.empty())
+        return false;
+
+    // 改写：先在原有的块中删去和复制，再在边上插入
+    std::vector<Var *> holders(m, nullptr);
+    std::vector<std::size_t> uses(m, 0);
+    for (int e : chosen)
+        for (int i = 0; i < n; i++)
+            if (antloc[i][e] || comp[i][e])
+                uses[e] += weight[i];
+    for (int e : chosen)
+        holders[e] = newLocal(fn, sample[e]->dst, uses[e]);
+    auto temps = collectTemps(fn);
+    for (int i = 0; i < n; i++) {
+        if (!fn.reachable[i])
+            continue;
+        auto &code = blocks[i]->code;
+        std::vector<std::list<Instruction *>::iterator> copies;
+        std::map<int, std::list<Instruction *>::iterator> first, lastSite;
+        Bits killedYet(m, false);
+        for (auto it = code.begin(); it != code.end(); it++) {
+            Instruction * ins = *it;
+            if (candidate(ins)) {
+                int e = ids[exprKey(ins)];
+                if (!killedYet[e] && !first.count(e))
+                    first[e] = it;
+                lastSite[e] = it;
+            }
+            std::vector<int> killed;
+            if (defOf(ins) != nullptr && operandOf.count(defOf(ins)->getName()))
+                killed = operandOf[defOf(ins)->getName()];
+            if (ins->getType() == InstructionType::Call_)
+                killed.insert(killed.end(), globalExprs.begin(), globalExprs.end());
+            for (int e : killed) {
+                killedYet[e] = true;
+                lastSite.erase(e);
+            }
+        }
+        for (int e : chosen) {
+            Var * h = holders[e];
+            bool deleted = antloc[i][e] && !laterin[i][e];
+            if (deleted) {
+                auto it = first[e];
+                Var * t = (*it)->dst;
+                *it = (Instruction *)new Assign(h, t);
+                copies.push_back(it);
+            }
+            if (comp[i][e] && !(deleted && lastSite[e] == first[e])) {
+                auto it = lastSite[e];
+                Var * t = (*it)->dst;
+                (*it)->dst = h;
+                auto copy = code.insert(std::next(it), (Instruction *)new Assign(h, t));
+                copies.push_back(copy);
+            }
+        }
+        for (auto copy : copies)
+            forwardCopy(blocks[i], copy, temps);
+    }
+
+    std::vector<std::pair<int, BasicBlock *>> added;
+    BasicBlock * entry = nullptr;
+    for (std::size_t k = 0; k < edges.size(); k++) {
+        auto [p, s] = edges[k];
+        std::vector<Instruction *> inserted;
+        for (int e : chosen)
+            if (later[k][e] && !laterin[s][e])
+                inserted.push_back((Instruction *)new Binary_op(((Binary_op *)sample[e])->code, sample[e]->src_1,
+                                                                sample[e]->src_2, holders[e]));
+        if (inserted.empty())
+            continue;
+        switch (place[k]) {
+            case AtEnd: {
+                auto &code = blocks[p]->code;
+                auto pos = code.end();
+                if (!code.empty() && isBranch(code.back()))
+                    pos = std::prev(pos);
+                code.insert(pos, inserted.begin(), inserted.end());
+                break;
+            }
+            case AtStart:
+                blocks[s]->code.insert(blocks[s]->code.begin(), inserted.begin(), inserted.end());
+                break;
+            case NewEntry:
+                entry = new BasicBlock();
+                entry->code.assign(inserted.begin(), inserted.end());
+                break;
+            case SplitFall: {
+                auto split = new BasicBlock();
+                split->code.assign(inserted.begin(), inserted.end());
+                added.emplace_back(p + 1, split);
+                break;
+            }
+            case SplitJump: {
+                auto split = new BasicBlock();
+                split->label = gen.newLabel();
+                split->code.assign(inserted.begin(), inserted.end());
+                split->code.push_back((Instruction *)new GOTO(blocks[s]->label));
+                branchLabel(blocks[p]->code.back()) = split->label;
+                added.emplace_back(splitAt, split);
+                break;
+            }
+        }
+    }
+    std::stable_sort(added.begin(), added.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (auto &[at, block] : added)
+        blocks.insert(blocks.begin() + at, block);
+    if (entry != nullptr)
+        blocks.insert(blocks.begin(), entry);
+    return true;
+}
@@ -0,0 +1,293 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 提升到局部变量的内存位置：标量全局变量，或者下标不变的一个数组元素（offset不为空）
+    struct Promoted {
+        Var * var;
+        Var * offset;
+        Var * local;
+        bool written;
+        // 数组元素有写但不是每次迭代都写时为true，用dirty记录循环中是否写过，为0时不写回
+        bool guarded;
+        Var * dirty;
+        // 按语义分析的算法估计的访问次数：每层循环按8次计
+        std::size_t weight;
+    };
+
+    bool sameCell(Var * a, Var * b) {
+        if (a->type == VarType::ConstVar || b->type == VarType::ConstVar)
+            return a->type == b->type && a->value == b->value;
+        return sameVar(a, b);
+    }
+}
+
+bool Optimizer::promoteLoops(FunctionBody &fn) {
+    std::set<std::string> done;
+    bool changed = false;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        // 外层循环在前，提升到最外层后内层循环中就不再有这些访问
+        auto loops = findLoops(fn);
+        std::reverse(loops.begin(), loops.end());
+        std::map<BasicBlock *, int> depth;
+        for (auto &loop : loops)
+            for (auto block : loop.blocks)
+                depth[block]++;
+        for (auto &loop : loops) {
+            if (done.count(loop.header->label))
+                continue;
+            done.insert(loop.header->label);
+            if (promoteLoop(fn, loop, depth, done)) {
+                rebuild(fn);
+                changed = progress = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::promoteLoop(FunctionBody &fn, Loop &loop, std::map<BasicBlock *, int> &depth,
+                            std::set<std::string> &done) {
+    /*
+     * 循环中没有调用和返回时，全局变量和下标不变的数组元素只在循环中访问，
+     * 在循环前读入一个新的局部变量，循环中改用这个局部变量，离开循环时写回：
+     * H:  local = g                 每个出口E换成
+     * H': 循环，g 换成 local          X:  g = local
+     *                                   GOTO E
+     * 夹在循环的块中间、只从循环进入的块（如break）直接在块首写回。
+     * 数组元素的下标可能越界，只有下标是界内的常量，或者每次迭代都会访问它时才能在循环前读入；
+     * 不是每次迭代都写的元素用一个标记记录是否写过，写过才写回
+     */
+    auto &blocks = fn.blocks;
+    BasicBlock * header = loop.header;
+    int h = header->index, l = h;
+    for (auto block : loop.blocks)
+        l = std::max(l, block->index);
+    if (header->label.empty())
+        return false;
+    std::vector<BasicBlock *> body, stubs;
+    for (int i = h; i <= l; i++) {
+        if (loop.blocks.count(blocks[i])) {
+            body.push_back(blocks[i]);
+            continue;
+        }
+        for (auto pred : blocks[i]->preds)
+            if (!loop.blocks.count(pred))
+                return false;
+        stubs.push_back(blocks[i]);
+    }
+    if (blocks[l]->code.empty() || blocks[l]->code.back()->getType() != InstructionType::GOTO_)
+        return false;
+
+    std::vector<Var *> defined;
+    std::vector<std::pair<BasicBlock *, Instruction *>> memory;
+    for (auto block : body)
+        for (auto ins : block->code) {
+            auto type = ins->getType();
+            if (type == InstructionType::Call_ || type == InstructionType::Return_)
+                return false;
+            if (type == InstructionType::Load_ || type == InstructionType::Store_)
+                memory.emplace_back(block, ins);
+            if (defOf(ins) != nullptr)
+                defined.push_back(defOf(ins));
+        }
+    auto definedInLoop = [&defined](Var * var) {
+        return std::any_of(defined.begin(), defined.end(), [var](Var * d) { return sameVar(d, var); });
+    };
+
+    // 支配所有回边的起点和所有离开循环的块的块每次迭代都会执行
+    std::vector<BasicBlock *> ends;
+    for (auto block : body) {
+        bool end = false;
+        for (auto succ : block->succs)
+            end = end || succ == header || !loop.blocks.count(succ);
+        if (end)
+            ends.push_back(block);
+    }
+    auto everyIteration = [&](BasicBlock * block) {
+        return std::all_of(ends.begin(), ends.end(), [&](BasicBlock * end) { return dominates(fn, block, end); });
+    };
+    auto inBounds = [this](Var * base, Var * offset) {
+        if (offset->type != VarType::ConstVar || base->isParam)
+            return false;
+        auto def = ctx->symbols.find(base->getName());
+        return def != ctx->symbols.end() && !def->second->accumulation.empty() && offset->value >= 0 &&
+               offset->value < def->second->accumulation.front();
+    };
+
+    // 候选的全局变量
+    std::vector<Promoted> promoted;
+    auto find = [&promoted](Var * var, Var * offset) -> Promoted * {
+        for (auto &p : promoted)
+            if (sameVar(p.var, var) && (p.offset == nullptr) == (offset == nullptr) &&
+                (offset == nullptr || sameCell(p.offset, offset)))
+                return &p;
+        return nullptr;
+    };
+    auto weightOf = [&depth](BasicBlock * block) { return std::size_t(1) << std::min(3 * depth[block], 30); };
+    for (auto block : body)
+        for (auto ins : block->code) {
+            std::vector<Var *> vars;
+            for (auto slot : useSlots(ins))
+                vars.push_back(*slot);
+            if (defOf(ins) != nullptr)
+                vars.push_back(defOf(ins));
+            for (auto var : vars)
+                if (var->type == VarType::GlobalVar && !var->isArray) {
+                    if (find(var, nullptr) == nullptr)
+                        promoted.push_back(Promoted{var, nullptr, nullptr, false, false, nullptr, 0});
+                    find(var, nullptr)->weight += weightOf(block);
+                }
+        }
+
+    // 候选的数组元素：循环中对这个数组以及可能与它重叠的数组的访问都是同一个下标不变的元素
+    bool unknownBase = false;
+    for (auto [block, ins] : memory) {
+        Var * base = ins->getType() == InstructionType::Load_ ? ins->src_1 : ins->src_2;
+        if (base->type == VarType::TempVar)
+            unknownBase = true;
+    }
+    for (auto block : body)
+        for (auto ins : block->code)
+            if (ins->getType() == InstructionType::Binary_op_ && ins->src_1->isArray)
+                unknownBase = true;
+    for (auto [block, ins] : memory) {
+        bool store = ins->getType() == InstructionType::Store_;
+        Var * base = store ? ins->src_2 : ins->src_1;
+        Var * offset = store ? ins->dst : ins->src_2;
+        if (unknownBase)
+            continue;
+        if (find(base, offset) != nullptr) {
+            find(base, offset)->weight += weightOf(block);
+            continue;
+        }
+        if (offset->type != VarType::ConstVar &&
+            (!isScalarLocal(offset) || offset->isArray || definedInLoop(offset)))
+            continue;
+        bool alone = true, loaded = inBounds(base, offset), written = false, stored = false;
+        for (auto [otherBlock, other] : memory) {
+            bool otherStore = other->getType() == InstructionType::Store_;
+            Var * otherBase = otherStore ? other->src_2 : other->src_1;
+            Var * otherOffset = otherStore ? other->dst : other->src_2;
+            if (!sameVar(base, otherBase) || !sameCell(offset, otherOffset)) {
+                alone = alone && !mayAlias(base, otherBase);
+                continue;
+            }
+            bool always = everyIteration(otherBlock);
+            loaded = loaded || always;
+            written = written || otherStore;
+            stored = stored || (otherStore && always);
+        }
+        if (alone && loaded)
+            promoted.push_back(Promoted{base, offset, nullptr, false, written && !stored, nullptr, weightOf(block)});
+    }
+    if (promoted.empty())
+        return false;
+
+    // 循环中的访问换成局部变量
+    for (auto &p : promoted) {
+        p.local = newLocal(fn, p.var, p.weight);
+        if (p.guarded)
+            p.dirty = newLocal(fn, p.var, p.weight);
+    }
+    for (auto block : body)
+        for (auto it = block->code.begin(); it != block->code.end(); ++it) {
+            auto &ins = *it;
+            if (ins->getType() == InstructionType::Load_ && find(ins->src_1, ins->src_2) != nullptr)
+                ins = (Instruction *)new Assign(find(ins->src_1, ins->src_2)->local, ins->dst);
+            else if (ins->getType() == InstructionType::Store_ && find(ins->src_2, ins->dst) != nullptr) {
+                Promoted * p = find(ins->src_2, ins->dst);
+                p->written = true;
+                ins = (Instruction *)new Assign(ins->src_1, p->local);
+                if (p->dirty != nullptr)
+                    block->code.insert(std::next(it), (Instruction *)new Assign(gen.getConstVar(1), p->dirty));
+            }
+            for (auto slot : useSlots(ins))
+                if ((*slot)->type == VarType::GlobalVar && find(*slot, nullptr) != nullptr)
+                    *slot = find(*slot, nullptr)->local;
+            if (defSlot(ins) != nullptr && (*defSlot(ins))->type == VarType::GlobalVar &&
+                find(*defSlot(ins), nullptr) != nullptr) {
+                Promoted * p = find(*defSlot(ins), nullptr);
+                p->written = true;
+                *defSlot(ins) = p->local;
+            }
+        }
+    bool written = std::any_of(promoted.begin(), promoted.end(), [](const Promoted &p) { return p.written; });
+    // 有标记的元素写成 IfZ dirty GOTO skip; 写回; skip:，块中的标号在重建时分开
+    auto writeBack = [this, &promoted](std::list<Instruction *> &code, std::list<Instruction *>::iterator pos) {
+        for (auto &p : promoted) {
+            if (!p.written)
+                continue;
+            std::string skip = p.dirty != nullptr ? gen.newLabel() : "";
+            if (p.dirty != nullptr)
+                code.insert(pos, (Instruction *)new IfZ(p.dirty, skip));
+            if (p.offset == nullptr)
+                code.insert(pos, (Instruction *)new Assign(p.local, p.var));
+            else
+                code.insert(pos, (Instruction *)new Store(p.local, p.var, p.offset));
+            if (p.dirty != nullptr)
+                code.insert(pos, (Instruction *)new Label(skip));
+        }
+    };
+
+    // 循环前读入，原来的标号给读入的块，循环内跳到header的改用新标号
+    auto pre = new BasicBlock();
+    pre->label = header->label;
+    for (auto &p : promoted) {
+        if (p.offset == nullptr)
+            pre->code.push_back((Instruction *)new Assign(p.var, p.local));
+        else
+            pre->code.push_back((Instruction *)new Load(p.var, p.offset, p.local));
+        if (p.dirty != nullptr)
+            pre->code.push_back((Instruction *)new Assign(gen.getConstVar(0), p.dirty));
+    }
+    header->label = gen.newLabel();
+    std::set<std::string> inside;
+    for (int i = h; i <= l; i++)
+        if (!blocks[i]->label.empty())
+            inside.insert(blocks[i]->label);
+    if (written)
+        for (auto stub : stubs)
+            writeBack(stub->code, stub->code.begin());
+
+    // 其余出口经过一个写回的块，紧接在循环后面的出口放在最后，不用跳转
+    std::vector<BasicBlock *> landings;
+    std::map<std::string, BasicBlock *> landingOf;
+    std::string next = l + 1 < (int)blocks.size() ? blocks[l + 1]->label : "";
+    for (auto block : body) {
+        Instruction * last = block->code.empty() ? nullptr : block->code.back();
+        if (last == nullptr || !isBranch(last))
+            continue;
+        std::string &target = branchLabel(last);
+        if (target == pre->label) {
+            target = header->label;
+            continue;
+        }
+        if (!written || inside.count(target))
+            continue;
+        if (!landingOf.count(target)) {
+            auto landing = new BasicBlock();
+            landing->label = gen.newLabel();
+            writeBack(landing->code, landing->code.end());
+            if (target != next)
+                landing->code.push_back((Instruction *)new GOTO(target));
+            landingOf[target] = landing;
+            if (target == next)
+                landings.push_back(landing);
+            else
+                landings.insert(landings.begin(), landing);
+        }
+        target = landingOf[target]->label;
+    }
+    blocks.insert(blocks.begin() + l + 1, landings.begin(), landings.end());
+    blocks.insert(blocks.begin() + h, pre);
+    done.insert(header->label);
+    return true;
+}
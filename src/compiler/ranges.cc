@@ -0,0 +1,362 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 取值区间 [lo, hi]；运算结果可能超出int范围（会回绕）时当作任意值
+    struct Range {
+        int64_t lo, hi;
+        bool operator==(const Range &other) const {
+            return lo == other.lo && hi == other.hi;
+        }
+    };
+
+    const Range whole{INT32_MIN, INT32_MAX};
+
+    Range make(int64_t lo, int64_t hi) {
+        if (lo < INT32_MIN || hi > INT32_MAX)
+            return whole;
+        return {lo, hi};
+    }
+
+    // 参与分析的变量：临时变量和标量局部变量，全局变量可能被调用改写，总是任意值
+    bool tracked(Var * var) {
+        return var != nullptr && ((var->type == VarType::TempVar && !var->isVector) || isScalarLocal(var));
+    }
+
+    int log2Of(int64_t v) {
+        if (v <= 0 || (v & (v - 1)) != 0)
+            return -1;
+        int k = 0;
+        while ((int64_t(1) << k) != v)
+            k++;
+        return k;
+    }
+
+    Range binaryRange(Binary_op::OpCode op, Range a, Range b) {
+        switch (op) {
+            case Binary_op::Add:
+                return make(a.lo + b.lo, a.hi + b.hi);
+            case Binary_op::Sub:
+                return make(a.lo - b.hi, a.hi - b.lo);
+            case Binary_op::Mul:
+            case Binary_op::Div: {
+                // 除数不跨过0时，乘除的结果都在四个角上取到极值
+                if (op == Binary_op::Div && b.lo <= 0 && b.hi >= 0)
+                    return whole;
+                int64_t corners[4] = {a.lo, a.lo, a.hi, a.hi};
+                int64_t by[4] = {b.lo, b.hi, b.lo, b.hi};
+                for (int i = 0; i < 4; i++)
+                    corners[i] = op == Binary_op::Mul ? corners[i] * by[i] : corners[i] / by[i];
+                return make(*std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4));
+            }
+            case Binary_op::Mod: {
+                // 余数的符号和被除数相同，绝对值小于除数的绝对值
+                if (b.lo <= 0 && b.hi >= 0)
+                    return whole;
+                int64_t bound = std::max(std::abs(b.lo), std::abs(b.hi)) - 1;
+                return {a.lo >= 0 ? 0 : std::max(a.lo, -bound), a.hi <= 0 ? 0 : std::min(a.hi, bound)};
+            }
+            case Binary_op::And:
+                if (a.lo >= 0 && b.lo >= 0)
+                    return {0, std::min(a.hi, b.hi)};
+                if (a.lo >= 0 || b.lo >= 0)
+                    return {0, a.lo >= 0 ? a.hi : b.hi};
+                return whole;
+            case Binary_op::Shr:
+                if (b.lo != b.hi || b.lo < 0 || b.lo > 31)
+                    return whole;
+                return {a.lo >> b.lo, a.hi >> b.lo};
+            default:
+                return {0, 1};
+        }
+    }
+
+    // 在 a op b 成立的前提下收紧两边的区间，不可能成立时返回false
+    bool refine(TokenType op, Range &a, Range &b) {
+        switch (op) {
+            case TokenType::op_less:
+                a.hi = std::min(a.hi, b.hi - 1);
+                b.lo = std::max(b.lo, a.lo + 1);
+                break;
+            case TokenType::op_lesseq:
+                a.hi = std::min(a.hi, b.hi);
+                b.lo = std::max(b.lo, a.lo);
+                break;
+            case TokenType::op_greater:
+                a.lo = std::max(a.lo, b.lo + 1);
+                b.hi = std::min(b.hi, a.hi - 1);
+                break;
+            case TokenType::op_greatereq:
+                a.lo = std::max(a.lo, b.lo);
+                b.hi = std::min(b.hi, a.hi);
+                break;
+            case TokenType::op_equaleq:
+                a.lo = b.lo = std::max(a.lo, b.lo);
+                a.hi = b.hi = std::min(a.hi, b.hi);
+                break;
+            default:
+                if (b.lo == b.hi) {
+                    if (a.lo == b.lo)
+                        a.lo++;
+                    if (a.hi == b.lo)
+                        a.hi--;
+                }
+                if (a.lo == a.hi) {
+                    if (b.lo == a.lo)
+                        b.lo++;
+                    if (b.hi == a.lo)
+                        b.hi--;
+                }
+        }
+        return a.lo <= a.hi && b.lo <= b.hi;
+    }
+
+    // __aeabi_idivmod(a, b) 前面紧挨着的两条Param
+    bool modParams(std::list<Instruction *> &code, std::list<Instruction *>::iterator call,
+                   std::list<Instruction *>::iterator &first) {
+        Instruction * ins = *call;
+        if (ins->getType() != InstructionType::Call_ || ((Call *)ins)->funLabel != "__aeabi_idivmod" ||
+            ins->numVars != 1)
+            return false;
+        auto it = call;
+        for (int i = 0; i < 2; i++) {
+            if (it == code.begin())
+                return false;
+            it--;
+            if ((*it)->getType() != InstructionType::Param_ || ((Param *)(*it))->funName != "__aeabi_idivmod")
+                return false;
+        }
+        first = it;
+        return true;
+    }
+}
+
+bool Optimizer::simplifyWithRanges(FunctionBody &fn) {
+    /*
+     * 按块求各变量在入口处的取值区间：条件跳转的两个出口分别按条件成立和不成立收紧区间，
+     * 汇合处取并集，循环头被更新多次后变大的一端直接放宽到int的边界，保证很快收敛。
+     * 得到区间后：
+     *   结果确定的条件跳转换成GOTO或者删去；
+     *   非负数除以2^k换成算术右移，对2^k取模（__aeabi_idivmod）换成和2^k-1按位与；
+     *   结果只有一个值的运算换成赋常量
+     */
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    std::map<std::string, int> ids;
+    for (auto block : blocks)
+        for (auto ins : block->code) {
+            std::vector<Var **> slots = useSlots(ins);
+            if (defSlot(ins) != nullptr)
+                slots.push_back(defSlot(ins));
+            for (auto slot : slots)
+                if (tracked(*slot) && !ids.count((*slot)->getName())) {
+                    int next = ids.size();
+                    ids[(*slot)->getName()] = next;
+                }
+        }
+    int m = ids.size();
+    typedef std::vector<Range> State;
+    auto rangeOf = [&ids](const State &state, Var * var) {
+        if (var->type == VarType::ConstVar)
+            return Range{var->value, var->value};
+        return tracked(var) ? state[ids.at(var->getName())] : whole;
+    };
+    auto transfer = [&](std::list<Instruction *> &code, std::list<Instruction *>::iterator it, State &state) {
+        Instruction * ins = *it;
+        Var * d = defOf(ins);
+        if (!tracked(d))
+            return;
+        Range r = whole;
+        std::list<Instruction *>::iterator first;
+        if (ins->getType() == InstructionType::Binary_op_)
+            r = binaryRange(((Binary_op *)ins)->code, rangeOf(state, ins->src_1), rangeOf(state, ins->src_2));
+        else if (ins->getType() == InstructionType::Assign_)
+            r = rangeOf(state, ins->src_1);
+        else if (modParams(code, it, first))
+            r = binaryRange(Binary_op::Mod, rangeOf(state, (*first)->src_1),
+                            rangeOf(state, (*std::next(first))->src_1));
+        state[ids.at(d->getName())] = r;
+    };
+    // 块末的跳转到两个出口时各自的区间，走不到的出口为空
+    auto branchOut = [&](BasicBlock * block, const State &state, std::vector<std::pair<BasicBlock *, State>> &outs) {
+        Instruction * last = block->code.empty() ? nullptr : block->code.back();
+        BasicBlock * fall = block->index + 1 < n ? blocks[block->index + 1] : nullptr;
+        if (last == nullptr || !isBranch(last)) {
+            if (fall != nullptr)
+                outs.emplace_back(fall, state);
+            return;
+        }
+        BasicBlock * target = fn.labels.at(branchLabel(last));
+        if (last->getType() == InstructionType::GOTO_) {
+            outs.emplace_back(target, state);
+            return;
+        }
+        TokenType op = TokenType::op_equaleq;
+        Var * a = last->src_1, * b = gen.getConstVar(0);
+        if (last->getType() == InstructionType::CMP_) {
+            op = ((CMP *)last)->opType;
+            b = last->src_2;
+        }
+        for (bool taken : {true, false}) {
+            State s = state;
+            Range x = rangeOf(s, a), y = rangeOf(s, b);
+            if (!refine(taken ? op : invertRelation(op), x, y))
+                continue;
+            if (tracked(a))
+                s[ids.at(a->getName())] = x;
+            if (tracked(b))
+                s[ids.at(b->getName())] = y;
+            BasicBlock * to = taken ? target : fall;
+            if (to != nullptr)
+                outs.emplace_back(to, s);
+        }
+    };
+
+    std::vector<State> in(n);
+    std::vector<bool> reached(n, false);
+    std::vector<int> visits(n, 0);
+    // 只在回边的目标处放宽，循环体内的区间仍由循环条件收紧
+    std::vector<bool> header(n, false);
+    for (auto block : blocks)
+        for (auto succ : block->succs)
+            if (succ->index <= block->index)
+                header[succ->index] = true;
+    std::set<int> work{0};
+    reached[0] = true;
+    in[0] = State(m, whole);
+    while (!work.empty()) {
+        int i = *work.begin();
+        work.erase(work.begin());
+        State state = in[i];
+        auto &code = blocks[i]->code;
+        for (auto it = code.begin(); it != code.end(); it++)
+            transfer(code, it, state);
+        std::vector<std::pair<BasicBlock *, State>> outs;
+        branchOut(blocks[i], state, outs);
+        for (auto &[to, s] : outs) {
+            int j = to->index;
+            if (!reached[j]) {
+                reached[j] = true;
+                in[j] = s;
+                work.insert(j);
+                continue;
+            }
+            bool widen = header[j] && ++visits[j] > rangeWidenAfter;
+            bool changed = false;
+            for (int v = 0; v < m; v++) {
+                Range r{std::min(in[j][v].lo, s[v].lo), std::max(in[j][v].hi, s[v].hi)};
+                if (r == in[j][v])
+                    continue;
+                if (widen && r.lo < in[j][v].lo)
+                    r.lo = INT32_MIN;
+                if (widen && r.hi > in[j][v].hi)
+                    r.hi = INT32_MAX;
+                in[j][v] = r;
+                changed = true;
+            }
+            if (changed)
+                work.insert(j);
+        }
+    }
+
+    // 块末的 t = x + c; t op K 改成 x op K - c：x 的区间保证 x + c 不回绕、两条指令之间 x 没有重新定值时才等价。
+    // 相等和不等按32位补码总是等价，在代数化简中已经改过
+    auto rebaseCompare = [&](std::list<Instruction *> &code, const State &state) {
+        Instruction * cmp = code.back();
+        TokenType op = ((CMP *)cmp)->opType;
+        if (op == TokenType::op_equaleq || op == TokenType::op_exclaimeq || !tracked(cmp->src_1) ||
+            cmp->src_2->type != VarType::ConstVar)
+            return false;
+        auto def = std::prev(code.end());
+        do {
+            if (def == code.begin())
+                return false;
+            def--;
+        } while (defOf(*def) == nullptr || !sameVar(defOf(*def), cmp->src_1));
+        Instruction * ins = *def;
+        if (ins->getType() != InstructionType::Binary_op_ || ins->src_2->type != VarType::ConstVar ||
+            !tracked(ins->src_1) || sameVar(ins->src_1, ins->dst))
+            return false;
+        auto arith = ((Binary_op *)ins)->code;
+        if (arith != Binary_op::Add && arith != Binary_op::Sub)
+            return false;
+        Var * x = ins->src_1;
+        for (auto it = std::next(def); it != code.end(); it++)
+            if (defOf(*it) != nullptr && sameVar(defOf(*it), x))
+                return false;
+        int64_t c = arith == Binary_op::Add ? ins->src_2->value : -ins->src_2->value;
+        int64_t bound = cmp->src_2->value - c;
+        Range r = rangeOf(state, x);
+        if (r.lo + c < INT32_MIN || r.hi + c > INT32_MAX || bound < INT32_MIN || bound > INT32_MAX)
+            return false;
+        cmp->src_1 = x;
+        cmp->src_2 = gen.getConstVar(bound);
+        return true;
+    };
+
+    bool changed = false, branched = false;
+    for (int i = 0; i < n; i++) {
+        if (!reached[i])
+            continue;
+        State state = in[i];
+        auto &code = blocks[i]->code;
+        for (auto it = code.begin(); it != code.end(); it++) {
+            Instruction * ins = *it;
+            std::list<Instruction *>::iterator first;
+            if (ins->getType() == InstructionType::Binary_op_ && ((Binary_op *)ins)->code == Binary_op::Div &&
+                ins->src_2->type == VarType::ConstVar && log2Of(ins->src_2->value) > 0 &&
+                rangeOf(state, ins->src_1).lo >= 0) {
+                *it = ins = (Instruction *)new Binary_op(Binary_op::Shr, ins->src_1,
+                                                         gen.getConstVar(log2Of(ins->src_2->value)), ins->dst);
+                changed = true;
+            } else if (modParams(code, it, first) && (*std::next(first))->src_1->type == VarType::ConstVar &&
+                       log2Of((*std::next(first))->src_1->value) >= 0 && rangeOf(state, (*first)->src_1).lo >= 0) {
+                Var * a = (*first)->src_1;
+                int64_t mask = (*std::next(first))->src_1->value - 1;
+                *it = ins = (Instruction *)new Binary_op(Binary_op::And, a, gen.getConstVar(mask), ins->src_1);
+                code.erase(first, std::next(first, 2));
+                changed = true;
+            }
+            transfer(code, it, state);
+            Var * d = defOf(ins);
+            if (ins->getType() == InstructionType::Binary_op_ && tracked(d)) {
+                Range r = state[ids.at(d->getName())];
+                if (r.lo == r.hi) {
+                    *it = (Instruction *)new Assign(gen.getConstVar(r.lo), d);
+                    changed = true;
+                }
+            }
+        }
+        Instruction * last = code.empty() ? nullptr : code.back();
+        if (last == nullptr || (last->getType() != InstructionType::CMP_ && last->getType() != InstructionType::IfZ_))
+            continue;
+        if (last->getType() == InstructionType::CMP_ && rebaseCompare(code, state))
+            changed = true;
+        std::vector<std::pair<BasicBlock *, State>> outs;
+        branchOut(blocks[i], state, outs);
+        bool canTake = false, canFall = false;
+        BasicBlock * target = fn.labels.at(branchLabel(last));
+        // 目标和下一个块相同时跳转本来就多余，留给CFG化简
+        if (i + 1 < n && target == blocks[i + 1])
+            continue;
+        for (auto &out : outs) {
+            canTake = canTake || out.first == target;
+            canFall = canFall || out.first != target;
+        }
+        if (canTake && !canFall)
+            code.back() = (Instruction *)new GOTO(branchLabel(last));
+        else if (!canTake && canFall)
+            code.pop_back();
+        else
+            continue;
+        changed = branched = true;
+    }
+    if (branched)
+        rebuild(fn);
+    return changed;
+}
@@ -1,5 +1,6 @@
 #include <compiler/sema.h>
 #include <cassert>
+#include <algorithm>
 
 namespace kisyshot::compiler {
 
@@ -54,7 +55,7 @@ namespace kisyshot::compiler {
             if (def->dimensionDef.empty()) {
                 std::tie(value, ok) =
                         checkCompileTimeConstExpr(def->initialValue);
-                def->values.emplace_back(ok ? value : 0);
+                def->addValue(0, ok ? value : 0);
                 def->accumulation.push_back(1);
             } else {
                 prepareArrayDef(def);
@@ -64,11 +65,11 @@ namespace kisyshot::compiler {
                                  std::dynamic_pointer_cast<
                                          ast::syntax::ArrayInitializeExpression>(
                                          def->initialValue),
-                                 def->accumulation.front());
-                    for (auto &expr : def->srcArray) {
+                                 0, def->accumulation.front());
+                    for (auto &[index, expr] : def->srcArray) {
 
                         std::tie(value, ok) = checkCompileTimeConstExpr(expr);
-                        def->values.emplace_back(ok ? value : 0);
+                        def->addValue(index, ok ? value : 0);
                     }
                 }
             }
@@ -101,6 +102,11 @@ namespace kisyshot::compiler {
                 }
             }
         }
+        markReentrantFunctions();
+        for (auto& [_, func] : _context->functions) {
+            if (func->body != nullptr)
+                layoutFrame(func);
+        }
 
     }
 
@@ -154,6 +160,8 @@ namespace kisyshot::compiler {
                         expr);
                 if (_context->functions.count(e->name->identifier) == 1) {
                     e->name->mangledId = e->name->identifier;
+                    if (_currFunc != nullptr)
+                        _currFunc->callees.insert(e->name->identifier);
                 } else {
                     // TODO: push error
                 }
@@ -167,12 +175,16 @@ namespace kisyshot::compiler {
                     ast::syntax::IdentifierExpression>(expr);
                 auto id = e->name->identifier;
                 auto&& s = _variables[id];
+                std::shared_ptr<ast::syntax::VarDefinition> def;
                 if (s.empty()) {
                     assert(_globals.count(id) == 1);
-                    e->name->mangledId = _globals[e->name->identifier]->varName->mangledId;
-                    break;
+                    def = _globals[e->name->identifier];
+                } else {
+                    def = s.top();
                 }
-                e->name->mangledId = s.top()->varName->mangledId;
+                e->name->mangledId = def->varName->mangledId;
+                // every loop level is assumed to run about 8 times
+                def->accessWeight += std::size_t(1) << std::min<std::size_t>(3 * _loopDepth, 30);
                 break;
             }
             case ast::syntax::SyntaxType::StringLiteralExpression: {
@@ -305,7 +317,8 @@ namespace kisyshot::compiler {
                         traverseExpression(def->initialValue);
                     }
 
-                    def->offset = _currFunc->stackSize;
+                    _currFunc->locals.push_back(def);
+                    _scopes[def.get()] = {_scopePoint++, SIZE_MAX};
                     size_t s = 1;
                     for (auto&& i : def->dimension) {
                         // TODO : push error
@@ -319,10 +332,8 @@ namespace kisyshot::compiler {
                             std::dynamic_pointer_cast<
                                 ast::syntax::ArrayInitializeExpression>(
                                 def->initialValue),
-                            s);
-                        _currFunc->stackSize += def->srcArray.size() * 4;
-                    } else {
-                        _currFunc->stackSize += 4;
+                            0, s);
+                        prepareInitTemplate(def);
                     }
                 }
                 break;
@@ -345,8 +356,10 @@ namespace kisyshot::compiler {
                 }
                 _layerNames.pop_back();
                 for (auto& id : _blockVars.top()) {
+                    _scopes[_variables[id].top().get()].second = _scopePoint;
                     _variables[id].pop();
                 }
+                _scopePoint++;
                 // pop block
                 _blockVars.pop();
                 break;
@@ -371,10 +384,12 @@ namespace kisyshot::compiler {
                     std::dynamic_pointer_cast<ast::syntax::WhileStatement>(
                         stmt);
                 // traverse expressions
+                _loopDepth++;
                 traverseExpression(s->condition);
                 _blockName = "w." + std::to_string(_blockId++) + "@" +
                              _layerNames.back();
                 traverseStatement(s->body);
+                _loopDepth--;
                 break;
             }
             case ast::syntax::SyntaxType::ExpressionStatement: {
@@ -415,38 +430,167 @@ namespace kisyshot::compiler {
         _blockVars.top().push_back(def->varName->identifier);
     }
 
+    void Sema::markReentrantFunctions() {
+        for (auto& [name, func] : _context->functions) {
+            // depth first search from the callees, the function is reentrant
+            // iff it can be reached again
+            std::set<std::string> visited;
+            std::vector<std::string> work(func->callees.begin(),
+                                          func->callees.end());
+            func->reentrant = false;
+            while (!work.empty()) {
+                auto callee = work.back();
+                work.pop_back();
+                if (callee == name) {
+                    func->reentrant = true;
+                    break;
+                }
+                if (!visited.insert(callee).second)
+                    continue;
+                auto& next = _context->functions[callee]->callees;
+                work.insert(work.end(), next.begin(), next.end());
+            }
+        }
+    }
+
+    void Sema::layoutFrame(const std::shared_ptr<ast::syntax::Function>& func) {
+        // params keep the lowest slots, callers store stacked args there.
+        // Everything else is placed by distance below fp: scalars first,
+        // then arrays, each in order of decreasing weight so the hottest
+        // slots get the shortest offsets. A slot may reuse space of any
+        // already placed one whose scope does not overlap its own.
+        struct Placed {
+            std::size_t pos, size, begin, end;
+        };
+        std::vector<Placed> placed;
+        auto place = [&](std::size_t from, std::size_t size,
+                         const std::pair<std::size_t, std::size_t>& scope) {
+            // first fit: try the region start and the end of every slot
+            std::vector<std::size_t> candidates{from};
+            for (auto& p : placed)
+                if (p.pos + p.size >= from)
+                    candidates.push_back(p.pos + p.size);
+            std::sort(candidates.begin(), candidates.end());
+            for (auto c : candidates) {
+                bool ok = true;
+                for (auto& p : placed) {
+                    bool alive = p.begin <= scope.second &&
+                                 scope.first <= p.end;
+                    bool overlap = p.pos < c + size && c < p.pos + p.size;
+                    if (alive && overlap) {
+                        ok = false;
+                        break;
+                    }
+                }
+                if (ok) {
+                    placed.push_back({c, size, scope.first, scope.second});
+                    return c;
+                }
+            }
+            return from;
+        };
+        auto slotSize = [](const auto& def) -> std::size_t {
+            return def->dimensionDef.empty() ? 4
+                                             : def->accumulation.front() * 4;
+        };
+        std::vector<std::shared_ptr<ast::syntax::VarDefinition>> order;
+        for (auto& def : func->locals) {
+            if (!func->reentrant && !def->dimensionDef.empty() &&
+                slotSize(def) >= ast::syntax::VarDefinition::staticMinBytes) {
+                // only one activation can be alive, so the array can live
+                // in .bss and does not grow the frame
+                def->staticLabel =
+                    ".LS" + std::to_string(_context->staticLocals.size());
+                _context->staticLocals.push_back(def);
+                continue;
+            }
+            order.push_back(def);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [](const auto& a, const auto& b) {
+                             if (a->dimensionDef.empty() !=
+                                 b->dimensionDef.empty())
+                                 return a->dimensionDef.empty();
+                             return a->accessWeight > b->accessWeight;
+                         });
+        // distance of each slot's top below fp
+        std::vector<std::size_t> pos;
+        std::size_t regionEnd = 0, scalarEnd = 0;
+        for (auto& def : order) {
+            std::size_t size = slotSize(def);
+            std::size_t from = def->dimensionDef.empty() ? 0 : scalarEnd;
+            pos.push_back(place(from, size, _scopes[def.get()]));
+            regionEnd = std::max(regionEnd, pos.back() + size);
+            if (def->dimensionDef.empty())
+                scalarEnd = regionEnd;
+        }
+        func->stackSize += regionEnd;
+        for (std::size_t i = 0; i < order.size(); i++)
+            order[i]->offset = func->stackSize - pos[i] - slotSize(order[i]);
+    }
+
     void Sema::flattenArray(
         const std::shared_ptr<ast::syntax::VarDefinition>& def,
         const std::shared_ptr<ast::syntax::ArrayInitializeExpression>& init,
-        size_t target, size_t dim) {
+        size_t start, size_t target, size_t dim) {
         if (dim >= def->dimension.size()) {
             // TODO: push array dimension wrong expr
         }
-        size_t current = def->srcArray.size();
-        size_t singleCount = 0;
+        // only explicit elements are recorded, everything else in
+        // [start, start + target) is implicitly zero
+        size_t pos = start;
         if (init != nullptr) {
             for (auto& i : init->array) {
                 if (i->getType() ==
                     ast::syntax::SyntaxType::ArrayInitializeExpression) {
-                    size_t innerTarget = target / def->dimension[dim];
-                    if (singleCount != 0) {
-                        assert(singleCount == innerTarget);
-                        singleCount = 0;
-                    }
-
+                    // a nested list initializes the largest sub-array that
+                    // begins at the current position
+                    if (dim >= def->dimension.size())
+                        break;
+                    size_t innerTarget = target;
+                    size_t innerDim = dim;
+                    do {
+                        innerTarget /= def->dimension[innerDim++];
+                    } while ((pos - start) % innerTarget != 0 &&
+                             innerDim < def->dimension.size());
+                    if (pos + innerTarget > start + target)
+                        break;
                     flattenArray(def,
                                  std::dynamic_pointer_cast<
                                      ast::syntax::ArrayInitializeExpression>(i),
-                                 innerTarget, dim + 1);
-                } else {
-                    def->srcArray.push_back(i);
-                    singleCount++;
+                                 pos, innerTarget, innerDim);
+                    pos += innerTarget;
+                } else if (pos < start + target) {
+                    def->srcArray.emplace_back(pos++, i);
                 }
             }
         }
-        while (def->srcArray.size() < current + target) {
-            def->srcArray.push_back(std::make_shared<ast::syntax::NumericLiteralExpression>());
+    }
+
+    void Sema::prepareInitTemplate(const std::shared_ptr<ast::syntax::VarDefinition> &def) {
+        if (def->initialValue == nullptr)
+            return;
+        // only arrays fully initialized by compile-time constants, and dense
+        // enough to be worth a copy, get a .rodata template
+        int value;
+        bool ok;
+        std::size_t nonZero = 0;
+        std::vector<std::pair<std::size_t, int>> values;
+        for (auto &[index, expr] : def->srcArray) {
+            std::tie(value, ok) = checkCompileTimeConstExpr(expr);
+            if (!ok)
+                return;
+            if (value != 0)
+                nonZero++;
+            values.emplace_back(index, value);
         }
+        if (nonZero < ast::syntax::VarDefinition::templateMinElements ||
+            nonZero * 2 < (std::size_t)def->accumulation.front())
+            return;
+        for (auto &[index, v] : values)
+            def->addValue(index, v);
+        def->initLabel = ".LI" + std::to_string(_context->initTemplates.size());
+        _context->initTemplates.push_back(def);
     }
 
     void Sema::prepareArrayDef(const std::shared_ptr<ast::syntax::VarDefinition> &def) {
@@ -0,0 +1,112 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+bool Optimizer::simplifyCFG(FunctionBody &fn) {
+    // 每一步改写后都重新切分基本块，直到不再变化
+    bool changed = false;
+    while (removeUnreachableBlocks(fn) || threadBranches(fn) || removeRedundantBranches(fn) ||
+           removeUnusedLabels(fn)) {
+        rebuild(fn);
+        changed = true;
+    }
+    return changed;
+}
+
+bool Optimizer::removeUnreachableBlocks(FunctionBody &fn) {
+    // 从入口走不到的块前面的块不会落入它，直接删去不影响其余块的顺序
+    std::vector<BasicBlock *> kept;
+    for (auto block : fn.blocks) {
+        if (block->index == 0 || fn.reachable[block->index])
+            kept.push_back(block);
+        else
+            delete block;
+    }
+    bool changed = kept.size() != fn.blocks.size();
+    fn.blocks.swap(kept);
+    return changed;
+}
+
+bool Optimizer::threadBranches(FunctionBody &fn) {
+    /*
+     * 跳转的目标块是空块或者只有一条GOTO时，直接跳到最终的目标：
+     * 空块落入下一个块，要求下一个块有标号；只有 GOTO L 的块换成 L
+     */
+    auto resolve = [&fn](std::string label) {
+        std::set<std::string> seen;
+        while (seen.insert(label).second) {
+            BasicBlock * block = fn.labels.at(label);
+            if (block->code.empty()) {
+                if (block->index + 1 >= (int)fn.blocks.size() || fn.blocks[block->index + 1]->label.empty())
+                    break;
+                label = fn.blocks[block->index + 1]->label;
+            } else if (block->code.size() == 1 && block->code.back()->getType() == InstructionType::GOTO_)
+                label = branchLabel(block->code.back());
+            else
+                break;
+        }
+        return label;
+    };
+    bool changed = false;
+    for (auto block : fn.blocks) {
+        Instruction * last = block->code.empty() ? nullptr : block->code.back();
+        if (last == nullptr || !isBranch(last))
+            continue;
+        std::string target = resolve(branchLabel(last));
+        if (target != branchLabel(last)) {
+            branchLabel(last) = target;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::removeRedundantBranches(FunctionBody &fn) {
+    /*
+     * 跳到紧接着的块的跳转删去；比较跳转越过一条GOTO时把条件取反：
+     *   if a op b GOTO L1          if a !op b GOTO L2
+     *   GOTO L2            =>    L1:
+     * L1:
+     * IfZ取反后要和常量0比较，代码生成时比cmp #0多一条指令，不改写
+     */
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    bool changed = false;
+    for (int i = 0; i + 1 < n; i++) {
+        Instruction * last = blocks[i]->code.empty() ? nullptr : blocks[i]->code.back();
+        if (last == nullptr || !isBranch(last))
+            continue;
+        if (branchLabel(last) == blocks[i + 1]->label) {
+            blocks[i]->code.pop_back();
+            changed = true;
+            continue;
+        }
+        if (last->getType() != InstructionType::CMP_ || i + 2 >= n || !blocks[i + 1]->label.empty() ||
+            blocks[i + 1]->code.size() != 1 || blocks[i + 1]->code.back()->getType() != InstructionType::GOTO_ ||
+            branchLabel(last) != blocks[i + 2]->label)
+            continue;
+        std::string target = branchLabel(blocks[i + 1]->code.back());
+        blocks[i]->code.back() =
+            (Instruction *)new CMP(invertRelation(((CMP *)last)->opType), last->src_1, last->src_2, target);
+        blocks[i + 1]->code.clear();
+        changed = true;
+    }
+    return changed;
+}
+
+bool Optimizer::removeUnusedLabels(FunctionBody &fn) {
+    // 没有跳转指向的标号删去，块和前一个块连成一块，代码生成时少一次寄存器写回
+    std::set<std::string> used;
+    for (auto block : fn.blocks)
+        if (!block->code.empty() && isBranch(block->code.back()))
+            used.insert(branchLabel(block->code.back()));
+    bool changed = false;
+    for (auto block : fn.blocks)
+        if (!block->label.empty() && !used.count(block->label)) {
+            block->label.clear();
+            changed = true;
+        }
+    return changed;
+}
@@ -0,0 +1,169 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+bool Optimizer::threadJumps(FunctionBody &fn) {
+    // 一遍中依次穿线各个前驱，前驱穿线后后继改为新的目标，接着从它穿线直到不能再穿；
+    // 改写过的前驱记在touched中，经过它们的路径留到下一遍，每遍只重建一次
+    bool changed = false;
+    bool progress = true;
+    int budget = threadMaxGrowth;
+    while (progress) {
+        progress = false;
+        std::set<BasicBlock *> touched;
+        for (auto block : fn.blocks) {
+            // 前驱改写过的块可能已经不可达，留到下一遍
+            bool stale = false;
+            for (auto p : block->preds)
+                stale = stale || touched.count(p);
+            while (!stale && fn.reachable[block->index] && threadJump(fn, block, budget, touched)) {
+                touched.insert(block);
+                progress = true;
+            }
+        }
+        if (progress) {
+            rebuild(fn);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::threadJump(FunctionBody &fn, BasicBlock * pred, int &budget, std::set<BasicBlock *> &touched) {
+    /*
+     * 短路求值生成
+     *   t = 1                  L1:  t = 0
+     *   GOTO L2                L2:  IfZ t GOTO L3
+     * 前驱中t的值已知，到L2的条件跳转结果确定，前驱直接跳到确定的后继。
+     * 从前驱出发沿唯一的后继往下走，条件跳转的操作数已知时继续走确定的方向，
+     * 途经的指令复制到前驱末尾（其中定值的临时变量换成新的），复制量受budget限制。
+     * touched中的块本遍已经改写，前驱后继已经过时，路径经过它们时留到下一遍
+     */
+    auto &blocks = fn.blocks;
+    int n = blocks.size();
+    Instruction * last = pred->code.empty() ? nullptr : pred->code.back();
+    if (pred->succs.size() != 1 || (last != nullptr && isBranch(last) && last->getType() != InstructionType::GOTO_))
+        return false;
+
+    // 按顺序执行指令，记录值为常量的标量
+    std::map<std::string, int64_t> known;
+    auto value = [&known](Var * var, int64_t &v) {
+        if (var->type == VarType::ConstVar) {
+            v = var->value;
+            return true;
+        }
+        auto it = known.find(var->getName());
+        if (it == known.end())
+            return false;
+        v = it->second;
+        return true;
+    };
+    auto simulate = [&](Instruction * ins) {
+        if (ins->getType() == InstructionType::Call_)
+            known.clear();
+        Var * d = defOf(ins);
+        if (d == nullptr)
+            return;
+        int64_t a, b, r;
+        if (d->isArray || d->isVector)
+            known.erase(d->getName());
+        else if (ins->getType() == InstructionType::Assign_ && value(ins->src_1, a))
+            known[d->getName()] = a;
+        else if (ins->getType() == InstructionType::Binary_op_ && value(ins->src_1, a) && value(ins->src_2, b) &&
+                 foldBinary(((Binary_op *)ins)->code, a, b, r))
+            known[d->getName()] = r;
+        else
+            known.erase(d->getName());
+    };
+    for (auto ins : pred->code)
+        simulate(ins);
+
+    std::vector<Instruction *> path;
+    std::vector<BasicBlock *> through;
+    std::set<BasicBlock *> seen{pred};
+    BasicBlock * target = nullptr;
+    std::size_t copied = 0, threaded = 0;
+    for (BasicBlock * cur = pred->succs[0]; cur != nullptr && seen.insert(cur).second;) {
+        if (touched.count(cur))
+            return false;
+        through.push_back(cur);
+        bool ok = true;
+        for (auto ins : cur->code) {
+            auto type = ins->getType();
+            if (isBranch(ins))
+                break;
+            if (type == InstructionType::Call_ || type == InstructionType::Param_ ||
+                type == InstructionType::Return_ || type == InstructionType::Vector_)
+                ok = false;
+            path.push_back(ins);
+            simulate(ins);
+        }
+        if (!ok || (int)path.size() > threadMaxCopy)
+            break;
+        Instruction * end = cur->code.empty() ? nullptr : cur->code.back();
+        BasicBlock * fall = cur->index + 1 < n ? blocks[cur->index + 1] : nullptr;
+        if (end == nullptr || !isBranch(end)) {
+            cur = fall;
+            continue;
+        }
+        if (end->getType() == InstructionType::GOTO_) {
+            cur = fn.labels.at(branchLabel(end));
+            continue;
+        }
+        int64_t a, b;
+        bool taken;
+        if (end->getType() == InstructionType::IfZ_ && value(end->src_1, a))
+            taken = a == 0;
+        else if (end->getType() == InstructionType::CMP_ && value(end->src_1, a) && value(end->src_2, b))
+            taken = evalRelation(((CMP *)end)->opType, a, b);
+        else
+            break;
+        cur = taken ? fn.labels.at(branchLabel(end)) : fall;
+        target = cur;
+        copied = path.size();
+        threaded = through.size();
+    }
+    if (target == nullptr || (int)copied + 1 > budget || (copied == 0 && target == pred->succs[0]))
+        return false;
+
+    // 复制的指令中定值的临时变量只能在经过的块中使用
+    std::set<std::string> defined;
+    for (std::size_t i = 0; i < copied; i++)
+        if (defOf(path[i]) != nullptr && defOf(path[i])->type == VarType::TempVar)
+            defined.insert(defOf(path[i])->getName());
+    std::set<BasicBlock *> inside(through.begin(), through.begin() + threaded);
+    for (auto block : blocks) {
+        if (inside.count(block))
+            continue;
+        for (auto ins : block->code)
+            for (auto slot : useSlots(ins))
+                if ((*slot)->type == VarType::TempVar && defined.count((*slot)->getName()))
+                    return false;
+    }
+
+    // 复制时只换掉在复制的指令中定值的临时变量，之前定值的保持原样
+    std::map<Var *, Var *> temps;
+    std::map<std::string, std::string> labels;
+    auto pos = pred->code.end();
+    if (last != nullptr && last->getType() == InstructionType::GOTO_)
+        pos = std::prev(pos);
+    for (std::size_t i = 0; i < copied; i++) {
+        for (auto slot : useSlots(path[i]))
+            if ((*slot)->type == VarType::TempVar && !temps.count(*slot))
+                temps[*slot] = *slot;
+        pred->code.insert(pos, cloneInstruction(path[i], temps, labels));
+    }
+    if (target->label.empty()) {
+        target->label = gen.newLabel();
+        fn.labels[target->label] = target;
+    }
+    if (pos != pred->code.end())
+        branchLabel(*pos) = target->label;
+    else
+        pred->code.push_back((Instruction *)new GOTO(target->label));
+    pred->succs = {target};
+    budget -= copied + 1;
+    return true;
+}
@@ -0,0 +1,170 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <algorithm>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 去掉一段代码中从第一个块出发走不到的块，段外的标号都视为出口
+    void pruneUnreachable(std::vector<BasicBlock *> &blocks) {
+        std::map<std::string, int> labels;
+        for (int i = 0; i < (int)blocks.size(); i++)
+            if (!blocks[i]->label.empty())
+                labels[blocks[i]->label] = i;
+        std::vector<bool> reachable(blocks.size(), false);
+        std::vector<int> work{0};
+        reachable[0] = true;
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            std::vector<int> succs;
+            Instruction * last = blocks[i]->code.empty() ? nullptr : blocks[i]->code.back();
+            if (last != nullptr && isBranch(last) && labels.count(branchLabel(last)))
+                succs.push_back(labels[branchLabel(last)]);
+            if ((last == nullptr || last->getType() != InstructionType::GOTO_) && i + 1 < (int)blocks.size())
+                succs.push_back(i + 1);
+            for (int s : succs)
+                if (!reachable[s]) {
+                    reachable[s] = true;
+                    work.push_back(s);
+                }
+        }
+        std::vector<BasicBlock *> kept;
+        for (int i = 0; i < (int)blocks.size(); i++) {
+            if (reachable[i])
+                kept.push_back(blocks[i]);
+            else
+                delete blocks[i];
+        }
+        blocks.swap(kept);
+    }
+}
+
+bool Optimizer::unswitchLoops(FunctionBody &fn) {
+    std::set<std::string> done;
+    bool changed = false;
+    int budget = unswitchMaxGrowth;
+    while (sweepLoops(fn, findLoops(fn), [&](Loop &loop) {
+        if (done.count(loop.header->label))
+            return false;
+        done.insert(loop.header->label);
+        return unswitchLoop(fn, loop, budget);
+    }))
+        changed = true;
+    return changed;
+}
+
+bool Optimizer::unswitchLoop(FunctionBody &fn, Loop &loop, int &budget) {
+    /*
+     * 循环中 if a op b GOTO L 的两个操作数都是循环不变量时，把判断提到循环前面：
+     * H:  if a op b GOTO HT
+     * HF: 条件不成立的循环，这个判断删去
+     * HT: 条件成立的循环，这个判断换成GOTO L
+     * 两份循环中走不到的块删去，其中还有不变的条件时可以继续拆分，复制的代码量受budget限制
+     */
+    auto &blocks = fn.blocks;
+    BasicBlock * header = loop.header;
+    int h = header->index, l = h;
+    for (auto block : loop.blocks)
+        l = std::max(l, block->index);
+    if (header->label.empty() || (int)loop.blocks.size() != l - h + 1)
+        return false;
+    for (int i = h; i <= l; i++)
+        if (!loop.blocks.count(blocks[i]))
+            return false;
+    if (blocks[l]->code.empty() || blocks[l]->code.back()->getType() != InstructionType::GOTO_)
+        return false;
+
+    // 循环中定值的变量和出现的临时变量，临时变量不能在循环外使用
+    std::set<Var *> loopTemps;
+    std::vector<Var *> defined;
+    bool hasCall = false;
+    int size = 0;
+    for (int i = h; i <= l; i++)
+        for (auto ins : blocks[i]->code) {
+            for (auto slot : useSlots(ins))
+                if ((*slot)->type == VarType::TempVar)
+                    loopTemps.insert(*slot);
+            if (Var * d = defOf(ins)) {
+                defined.push_back(d);
+                if (d->type == VarType::TempVar)
+                    loopTemps.insert(d);
+            }
+            if (ins->getType() == InstructionType::Call_)
+                hasCall = true;
+            size++;
+        }
+    if (size > budget)
+        return false;
+    auto invariant = [&](Var * var) {
+        if (var->type == VarType::ConstVar)
+            return true;
+        if ((var->type != VarType::LocalVar && var->type != VarType::GlobalVar) || var->isArray)
+            return false;
+        if (var->type == VarType::GlobalVar && hasCall)
+            return false;
+        return std::none_of(defined.begin(), defined.end(), [var](Var * d) { return sameVar(d, var); });
+    };
+
+    // 找一个操作数都不变、两个方向都还在循环中或者离开循环的条件跳转
+    Instruction * cond = nullptr;
+    int condBlock = -1;
+    for (int i = h; i <= l && cond == nullptr; i++) {
+        Instruction * last = blocks[i]->code.empty() ? nullptr : blocks[i]->code.back();
+        if (last == nullptr || (last->getType() != InstructionType::CMP_ && last->getType() != InstructionType::IfZ_))
+            continue;
+        bool ok = true;
+        for (auto slot : useSlots(last))
+            if (!invariant(*slot))
+                ok = false;
+        if (ok && !(last->getType() == InstructionType::CMP_ && last->src_1->type == VarType::ConstVar &&
+                    last->src_2->type == VarType::ConstVar)) {
+            cond = last;
+            condBlock = i;
+        }
+    }
+    if (cond == nullptr)
+        return false;
+    for (int i = 0; i < (int)blocks.size(); i++) {
+        if (i >= h && i <= l)
+            continue;
+        for (auto ins : blocks[i]->code) {
+            for (auto slot : useSlots(ins))
+                if (loopTemps.count(*slot))
+                    return false;
+            if (defOf(ins) != nullptr && loopTemps.count(defOf(ins)))
+                return false;
+        }
+    }
+
+    // 条件成立的一份是复制出来的循环，原来的循环换用新标号作为不成立的一份
+    std::vector<BasicBlock *> original(blocks.begin() + h, blocks.begin() + l + 1);
+    std::vector<BasicBlock *> taken = cloneBlocks(original);
+    Instruction *& copied = taken[condBlock - h]->code.back();
+    copied = (Instruction *)new GOTO(branchLabel(copied));
+    std::string entry = header->label;
+    header->label = gen.newLabel();
+    for (auto block : original)
+        if (!block->code.empty() && isBranch(block->code.back()) && branchLabel(block->code.back()) == entry)
+            branchLabel(block->code.back()) = header->label;
+    blocks[condBlock]->code.pop_back();
+    pruneUnreachable(original);
+    pruneUnreachable(taken);
+
+    auto test = new BasicBlock();
+    test->label = entry;
+    Instruction * hoisted;
+    if (cond->getType() == InstructionType::CMP_)
+        hoisted = (Instruction *)new CMP(((CMP *)cond)->opType, cond->src_1, cond->src_2, taken.front()->label);
+    else
+        hoisted = (Instruction *)new IfZ(cond->src_1, taken.front()->label);
+    test->code.push_back(hoisted);
+    std::vector<BasicBlock *> unswitched{test};
+    unswitched.insert(unswitched.end(), original.begin(), original.end());
+    unswitched.insert(unswitched.end(), taken.begin(), taken.end());
+    blocks.erase(blocks.begin() + h, blocks.begin() + l + 1);
+    blocks.insert(blocks.begin() + h, unswitched.begin(), unswitched.end());
+    budget -= size;
+    return true;
+}
@@ -0,0 +1,447 @@
+#include <compiler/optimizer.h>
+#include <compiler/tac_utils.h>
+#include <compiler/affine.h>
+#include <algorithm>
+#include <climits>
+
+using namespace kisyshot::ast;
+using namespace kisyshot::compiler;
+
+namespace {
+    // 循环中的一次数组访问，pos是在循环体中的顺序
+    struct Access {
+        Var * base;
+        Affine offset;
+        bool store;
+        int pos;
+    };
+}
+
+bool Optimizer::vectorizeLoops(FunctionBody &fn) {
+    std::set<std::string> done;
+    bool changed = false;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (auto &loop : findLoops(fn)) {
+            if (done.count(loop.header->label))
+                continue;
+            done.insert(loop.header->label);
+            if (vectorizeLoop(fn, loop, done)) {
+                rebuild(fn);
+                changed = progress = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::vectorizeLoop(FunctionBody &fn, Loop &loop, std::set<std::string> &done) {
+    /*
+     * 循环体只有一个基本块、步长为1的计数循环，数组下标都是 i + 不变量：
+     * H:   [形参数组之间可能重叠时在运行时检查，重叠则 GOTO S]
+     *      [归约变量的向量部分和置0]
+     * V:   b = n - 3
+     *      if i !op b GOTO S
+     *      [一次处理4个元素的循环体]
+     *      i = i + 4
+     *      GOTO V
+     *      [把每个部分和的4个lane加回归约变量]
+     * S:   原来的循环，处理剩下不足4次的迭代
+     */
+    CountedLoop info;
+    if (!matchCountedLoop(fn, loop, info) || info.l != info.h + 1 || info.step != 1 || info.hasCall)
+        return false;
+    auto &blocks = fn.blocks;
+    BasicBlock * header = blocks[info.h];
+    BasicBlock * body = blocks[info.l];
+    Var * iv = info.iv;
+    // 归纳变量在循环体的最后更新，循环中不能给归约变量以外的局部变量和全局变量赋值；
+    // 归约的每个lane是一个部分和，NEON没有把各lane相乘的指令，只处理加减
+    std::vector<Reduction> reductions = matchReductions(fn, info);
+    std::map<Instruction *, Reduction *> reductionAt;
+    for (auto &r : reductions) {
+        if (r.op == Binary_op::Mul)
+            return false;
+        reductionAt[r.update] = reductionAt[r.def] = &r;
+    }
+    std::vector<Instruction *> code(body->code.begin(), std::prev(body->code.end()));
+    if (code.empty() || code.back() != info.ivDef)
+        return false;
+    code.pop_back();
+    if (info.inc != info.ivDef) {
+        if (code.empty() || code.back() != info.inc)
+            return false;
+        code.pop_back();
+    }
+    for (auto &[var, n] : info.defs)
+        if (var->type != VarType::TempVar && !sameVar(var, iv) &&
+            std::none_of(reductions.begin(), reductions.end(), [var](const Reduction &r) { return sameVar(r.var, var); }))
+            return false;
+
+    // 作为数据（而不只是下标）使用的临时变量
+    std::set<Var *> dataTemps;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto ins : code) {
+            std::vector<Var *> data;
+            switch (ins->getType()) {
+                case InstructionType::Load_:
+                    break;
+                case InstructionType::Store_:
+                    data.push_back(ins->src_1);
+                    break;
+                case InstructionType::Binary_op_:
+                case InstructionType::Assign_:
+                    if (dataTemps.count(defOf(ins)) || reductionAt.count(ins))
+                        for (auto slot : useSlots(ins))
+                            data.push_back(*slot);
+                    break;
+                default:
+                    return false;
+            }
+            for (auto var : data)
+                if (var->type == VarType::TempVar && dataTemps.insert(var).second)
+                    changed = true;
+        }
+    }
+
+    // 逐条生成向量循环体：随lane变化的数据用向量计算，下标和不变量仍按标量计算第一个lane的值
+    std::map<Var *, Affine> forms;
+    std::map<std::string, Var *> atoms;
+    int opaque = 0;
+    auto newAtom = [&opaque]() {
+        Affine a;
+        a.terms["#" + std::to_string(opaque++)] = 1;
+        return a;
+    };
+    Affine unknown;
+    unknown.ok = false;
+    auto formOf = [&](Var * var) {
+        Affine a;
+        if (var->type == VarType::ConstVar)
+            a.c = var->value;
+        else if (sameVar(var, iv))
+            a.iv = 1;
+        else if (var->type == VarType::TempVar)
+            a = forms.count(var) ? forms[var] : unknown;
+        else if (var->isArray)
+            a = unknown;
+        else {
+            a.terms[var->getName()] = 1;
+            atoms[var->getName()] = var;
+        }
+        return a;
+    };
+    auto binaryForm = [&](Binary_op::OpCode op, const Affine &a, const Affine &b) {
+        if (!a.ok || !b.ok)
+            return unknown;
+        bool aConst = a.terms.empty() && a.iv == 0, bConst = b.terms.empty() && b.iv == 0;
+        if (op == Binary_op::Add)
+            return combine(a, b, 1);
+        if (op == Binary_op::Sub)
+            return combine(a, b, -1);
+        if (op == Binary_op::Mul && aConst)
+            return scaled(b, a.c);
+        if (op == Binary_op::Mul && bConst)
+            return scaled(a, b.c);
+        return a.iv == 0 && b.iv == 0 ? newAtom() : unknown;
+    };
+
+    std::vector<Instruction *> vbody;
+    std::map<Var *, Var *> temps;
+    std::map<std::string, std::string> labels;
+    std::map<Var *, Var *> vec;
+    std::map<std::string, Var *> dups;
+    Var * lanes = nullptr;
+    std::vector<Access> accesses;
+    auto newVector = [this]() {
+        Var * v = gen.newTempVar();
+        v->isVector = true;
+        return v;
+    };
+    auto scalar = [&temps](Var * var) {
+        auto it = temps.find(var);
+        return it == temps.end() ? var : it->second;
+    };
+    auto varying = [&](Var * var) {
+        return vec.count(var) != 0 || sameVar(var, iv);
+    };
+    auto vectorOf = [&](Var * var) {
+        if (vec.count(var))
+            return vec[var];
+        if (sameVar(var, iv)) {
+            if (lanes == nullptr) {
+                lanes = newVector();
+                vbody.push_back((Instruction *)new VectorOp(VectorOp::Index, iv, lanes));
+            }
+            return lanes;
+        }
+        // 不变量广播到4个lane；临时变量可能被重新定值，不复用
+        bool reuse = var->type != VarType::TempVar;
+        if (reuse && dups.count(var->getName()))
+            return dups[var->getName()];
+        Var * v = newVector();
+        vbody.push_back((Instruction *)new VectorOp(VectorOp::Dup, scalar(var), v));
+        if (reuse)
+            dups[var->getName()] = v;
+        return v;
+    };
+    auto keepScalar = [&](Instruction * ins) {
+        for (auto slot : useSlots(ins))
+            if (vec.count(*slot))
+                return false;
+        vbody.push_back(cloneInstruction(ins, temps, labels));
+        vec.erase(defOf(ins));
+        return true;
+    };
+    std::vector<Var *> partials;
+    for (std::size_t r = 0; r < reductions.size(); r++)
+        partials.push_back(newVector());
+    int pos = 0;
+    bool hasStore = false;
+    for (auto ins : code) {
+        pos++;
+        if (reductionAt.count(ins)) {
+            // t = s op x 换成 v = v op x，s = t 不再需要
+            Reduction * r = reductionAt[ins];
+            if (ins != r->update)
+                continue;
+            Var * acc = partials[r - reductions.data()];
+            Var * x = sameVar(ins->src_1, r->var) ? ins->src_2 : ins->src_1;
+            auto vop = r->op == Binary_op::Add ? VectorOp::Add : VectorOp::Sub;
+            vbody.push_back((Instruction *)new VectorOp(vop, acc, vectorOf(x), acc));
+            continue;
+        }
+        switch (ins->getType()) {
+            case InstructionType::Load_: {
+                Affine f = formOf(ins->src_2);
+                if (ins->src_1->type == VarType::TempVar || !f.ok || (f.iv != 0 && f.iv != 1))
+                    return false;
+                accesses.push_back(Access{ins->src_1, f, false, pos});
+                if (f.iv == 0) {
+                    if (!keepScalar(ins))
+                        return false;
+                    forms[ins->dst] = newAtom();
+                    break;
+                }
+                Var * v = newVector();
+                vbody.push_back((Instruction *)new VectorOp(VectorOp::Load, ins->src_1, scalar(ins->src_2), v));
+                vec[ins->dst] = v;
+                forms[ins->dst] = unknown;
+                break;
+            }
+            case InstructionType::Store_: {
+                Affine f = formOf(ins->dst);
+                if (ins->src_2->type == VarType::TempVar || !f.ok || f.iv != 1)
+                    return false;
+                accesses.push_back(Access{ins->src_2, f, true, pos});
+                Var * v = vectorOf(ins->src_1);
+                vbody.push_back((Instruction *)new VectorOp(VectorOp::Store, v, ins->src_2, scalar(ins->dst)));
+                hasStore = true;
+                break;
+            }
+            case InstructionType::Binary_op_: {
+                auto op = ((Binary_op *)ins)->code;
+                if (ins->src_1->isArray)
+                    return false;
+                if (dataTemps.count(ins->dst) && (varying(ins->src_1) || varying(ins->src_2))) {
+                    // NEON没有整数除法
+                    if (op != Binary_op::Add && op != Binary_op::Sub && op != Binary_op::Mul)
+                        return false;
+                    auto vop = op == Binary_op::Add ? VectorOp::Add : op == Binary_op::Sub ? VectorOp::Sub : VectorOp::Mul;
+                    Var * a = vectorOf(ins->src_1);
+                    Var * b = vectorOf(ins->src_2);
+                    Var * v = newVector();
+                    vbody.push_back((Instruction *)new VectorOp(vop, a, b, v));
+                    vec[ins->dst] = v;
+                    forms[ins->dst] = unknown;
+                    break;
+                }
+                Affine f = binaryForm(op, formOf(ins->src_1), formOf(ins->src_2));
+                if (!keepScalar(ins))
+                    return false;
+                forms[ins->dst] = f;
+                break;
+            }
+            case InstructionType::Assign_: {
+                if (dataTemps.count(ins->src_2) && varying(ins->src_1)) {
+                    vec[ins->src_2] = vectorOf(ins->src_1);
+                    forms[ins->src_2] = unknown;
+                    break;
+                }
+                Affine f = formOf(ins->src_1);
+                if (!keepScalar(ins))
+                    return false;
+                forms[ins->src_2] = f;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    if (!hasStore && reductions.empty())
+        return false;
+
+    // 同时活跃的向量不能超过可用的q寄存器，部分和在整个循环中都活跃
+    std::set<Var *> accs(partials.begin(), partials.end());
+    std::map<Var *, int> lastUse;
+    for (int i = 0; i < (int)vbody.size(); i++) {
+        for (auto slot : useSlots(vbody[i]))
+            if ((*slot)->isVector && !accs.count(*slot))
+                lastUse[*slot] = i;
+        if (defOf(vbody[i]) != nullptr && defOf(vbody[i])->isVector && !accs.count(defOf(vbody[i])))
+            lastUse.emplace(defOf(vbody[i]), i);
+    }
+    int live = (int)accs.size(), peak = live;
+    for (int i = 0; i < (int)vbody.size(); i++) {
+        if (defOf(vbody[i]) != nullptr && defOf(vbody[i])->isVector && !accs.count(defOf(vbody[i])))
+            peak = std::max(peak, ++live);
+        for (auto &[var, last] : lastUse)
+            if (last == i)
+                live--;
+    }
+    if (peak > vectorMaxLive)
+        return false;
+
+    // 依赖检查：同一数组按下标之差静态判断，可能重叠的不同数组留到运行时检查
+    std::vector<std::pair<Access *, Access *>> checks;
+    for (int i = 0; i < (int)accesses.size(); i++)
+        for (int j = i + 1; j < (int)accesses.size(); j++) {
+            Access * a = &accesses[i], * b = &accesses[j];
+            if ((!a->store && !b->store) || !mayAlias(a->base, b->base))
+                continue;
+            // 下标不随i变化的读取在每次向量迭代只做一次，不能被循环中的写影响
+            if (a->offset.iv == 0 || b->offset.iv == 0)
+                return false;
+            if (sameVar(a->base, b->base) && a->offset.terms == b->offset.terms) {
+                Access * s = a->store ? a : b, * x = a->store ? b : a;
+                int64_t d = x->offset.c - s->offset.c;
+                // 访问同一个元素、相距一个向量以上、或者先读后写的元素还没有被写过，都与逐个执行一致
+                if (d == 0 || d >= vectorWidth || d <= -vectorWidth || (!x->store && d > 0 && x->pos < s->pos))
+                    continue;
+                return false;
+            }
+            for (auto access : {a, b})
+                for (auto &[name, coef] : access->offset.terms)
+                    if (name[0] == '#')
+                        return false;
+            checks.emplace_back(a, b);
+        }
+
+    std::string vectorLabel = gen.newLabel();
+    std::string scalarLabel = gen.newLabel();
+    std::vector<BasicBlock *> added;
+    auto newBlock = [&added](const std::string &label) {
+        auto block = new BasicBlock();
+        block->label = label;
+        added.push_back(block);
+        return block;
+    };
+    auto emit = [](BasicBlock * block, Instruction * ins) {
+        block->code.push_back(ins);
+    };
+    auto newTemp = [this](bool isArray) {
+        Var * t = gen.newTempVar();
+        t->isArray = isArray;
+        return t;
+    };
+    // header中计算界的指令，复制时换用新的临时变量
+    auto cloneHeader = [&](BasicBlock * block) {
+        std::map<Var *, Var *> headerTemps;
+        std::map<std::string, std::string> headerLabels;
+        for (auto ins : header->code)
+            if (ins != info.test)
+                emit(block, cloneInstruction(ins, headerTemps, headerLabels));
+        auto it = headerTemps.find(info.bound);
+        return it == headerTemps.end() ? info.bound : it->second;
+    };
+
+    // b = n - 3 不能回绕
+    if (info.bound->type == VarType::ConstVar && info.bound->value - (vectorWidth - 1) < INT32_MIN)
+        return false;
+    BasicBlock * cur = newBlock(header->label);
+    if (info.bound->type != VarType::ConstVar) {
+        Var * bound = cloneHeader(cur);
+        emit(cur, (Instruction *)new CMP(TokenType::op_less, bound, gen.getConstVar((int64_t)INT32_MIN + vectorWidth - 1), scalarLabel));
+        cur = newBlock("");
+    }
+    for (auto &[a, b] : checks) {
+        // 两个访问在这次迭代的地址之差d，d为0或者|d|不小于一个向量时互不影响
+        Var * addr[2];
+        for (int k = 0; k < 2; k++) {
+            Access * access = k == 0 ? a : b;
+            Var * off = iv;
+            for (auto &[name, coef] : access->offset.terms) {
+                Var * term = atoms[name];
+                if (coef != 1) {
+                    Var * t = newTemp(false);
+                    emit(cur, (Instruction *)new Binary_op(Binary_op::Mul, term, gen.getConstVar(coef), t));
+                    term = t;
+                }
+                Var * t = newTemp(false);
+                emit(cur, (Instruction *)new Binary_op(Binary_op::Add, off, term, t));
+                off = t;
+            }
+            if (access->offset.c != 0) {
+                Var * t = newTemp(false);
+                emit(cur, (Instruction *)new Binary_op(Binary_op::Add, off, gen.getConstVar(access->offset.c), t));
+                off = t;
+            }
+            Var * element = newTemp(true);
+            emit(cur, (Instruction *)new Binary_op(Binary_op::Add, access->base, off, element));
+            addr[k] = newTemp(false);
+            emit(cur, (Instruction *)new Assign(element, addr[k]));
+        }
+        Var * d = newTemp(false);
+        emit(cur, (Instruction *)new Binary_op(Binary_op::Sub, addr[0], addr[1], d));
+        std::string disjoint = gen.newLabel();
+        emit(cur, (Instruction *)new CMP(TokenType::op_equaleq, d, gen.getConstVar(0), disjoint));
+        cur = newBlock("");
+        emit(cur, (Instruction *)new CMP(TokenType::op_greatereq, d, gen.getConstVar(vectorWidth * 4), disjoint));
+        cur = newBlock("");
+        emit(cur, (Instruction *)new CMP(TokenType::op_greater, d, gen.getConstVar(-vectorWidth * 4), scalarLabel));
+        cur = newBlock(disjoint);
+    }
+
+    // 向量循环，离开时先合并部分和
+    for (auto acc : partials)
+        emit(cur, (Instruction *)new VectorOp(VectorOp::Dup, gen.getConstVar(0), acc));
+    std::string exitLabel = reductions.empty() ? scalarLabel : gen.newLabel();
+    cur = newBlock(vectorLabel);
+    Var * bound = cloneHeader(cur);
+    Var * last;
+    if (bound->type == VarType::ConstVar)
+        last = gen.getConstVar(bound->value - (vectorWidth - 1));
+    else {
+        last = newTemp(false);
+        emit(cur, (Instruction *)new Binary_op(Binary_op::Sub, bound, gen.getConstVar(vectorWidth - 1), last));
+    }
+    emit(cur, (Instruction *)new CMP(invertRelation(info.cont), iv, last, exitLabel));
+    cur = newBlock("");
+    for (auto ins : vbody)
+        emit(cur, ins);
+    Var * next = newTemp(false);
+    emit(cur, (Instruction *)new Binary_op(Binary_op::Add, iv, gen.getConstVar(vectorWidth), next));
+    emit(cur, (Instruction *)new Assign(next, iv));
+    emit(cur, (Instruction *)new GOTO(vectorLabel));
+    if (!reductions.empty()) {
+        cur = newBlock(exitLabel);
+        for (std::size_t r = 0; r < reductions.size(); r++) {
+            Var * sum = newTemp(false);
+            Var * t = newTemp(false);
+            emit(cur, (Instruction *)new VectorOp(VectorOp::Sum, partials[r], sum));
+            emit(cur, (Instruction *)new Binary_op(Binary_op::Add, reductions[r].var, sum, t));
+            emit(cur, (Instruction *)new Assign(t, reductions[r].var));
+        }
+    }
+
+    // 原来的循环换用新标号，处理剩余的迭代
+    header->label = scalarLabel;
+    branchLabel(body->code.back()) = scalarLabel;
+    blocks.insert(blocks.begin() + info.h, added.begin(), added.end());
+    done.insert(vectorLabel);
+    done.insert(scalarLabel);
+    return true;
+}
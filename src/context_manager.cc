@@ -57,7 +57,9 @@ namespace kisyshot{
              "void putarray(int n,int a[]);\n"
              "void _sysy_starttime(int lineno);\n"
              "void _sysy_stoptime(int lineno);\n"
-             "int __aeabi_idivmod(int a, int b);\n";
+             "int __aeabi_idivmod(int a, int b);\n"
+             "void __aeabi_memclr4(int dest[], int n);\n"
+             "void __aeabi_memcpy4(int dest[], int src[], int n);\n";
         auto ctx = create(s, path);
         return ctx;
     }
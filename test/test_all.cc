@@ -61,20 +61,26 @@ CommandResult exec(const std::string& command) {
 
 int main(int argc, char* argv[]) {
     //--- filenames are unique so we can use a set
-    std::set<std::filesystem::path> sorted;
+    //--- the optimize cases run a second time with -mfpu=neon to exercise the vectorizer
+    std::set<std::pair<std::filesystem::path, std::string>> sorted;
 
-    for (auto& entry :
-         std::filesystem::directory_iterator("cases/function_test2021"))
-        sorted.insert(entry.path());
+    for (auto dir : {"cases/function_test2021", "cases/optimize"})
+        for (auto& entry : std::filesystem::directory_iterator(dir)) {
+            sorted.emplace(entry.path(), "");
+            if (std::string(dir) == "cases/optimize")
+                sorted.emplace(entry.path(), "-mfpu=neon");
+        }
 
-    for (const auto& fpath : sorted) {
+    for (const auto& [fpath, flags] : sorted) {
         if (fpath.extension() == ".sy") {
             std::string p = fpath.string();
             p.replace(p.find(".sy"), 3, "");
             std::string in = p + ".in";
             
             std::string out = p + ".out";
-            auto mid = exec(("./kisyshot -S -o " + p + ".s " + fpath.string()));
+            if (!flags.empty())
+                p += ".neon";
+            auto mid = exec(("./kisyshot " + flags + " -S -o " + p + ".s " + fpath.string()));
             if (argc > 1 && std::string(argv[1]) == std::string("-r")) {
 
                 exec(
@@ -91,10 +97,10 @@ int main(int argc, char* argv[]) {
 
                 }
 
-                std::cout << "file: " << fpath.string() << std::endl;
+                std::cout << "file: " << fpath.string() << " " << flags << std::endl;
                 std::cout << run << ", and expected: " << expected(out) << std::endl << std::endl;
             } else {
-                std::cout << "file: " << fpath.string() << std::endl;
+                std::cout << "file: " << fpath.string() << " " << flags << std::endl;
 		std::cout << mid << std::endl;
             }
         }